@@ -63,9 +63,12 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 /*
  * TLB entry fields.
  *
- * Note that the MIPS has support for a 6-bit address space ID. In the
- * interests of simplicity, we don't use it. The fields related to it
- * (TLBLO_GLOBAL and TLBHI_PID) can be left always zero, as can the
+ * The MIPS has support for a 6-bit address space ID in TLBHI_PID. An
+ * entry only matches while the PID in the EntryHi register equals its
+ * own, and since tlb_probe and tlb_write leave their entryhi argument
+ * in that register, every entryhi passed to them must carry the PID of
+ * the address space that is running. TLBLO_GLOBAL, which would make an
+ * entry match any PID, is not used and can be left zero, as can the
  * bits that aren't assigned a meaning.
  *
  * The TLBLO_DIRTY bit is actually a write privilege bit - it is not
@@ -78,7 +81,9 @@ int tlb_probe(uint32_t entryhi, uint32_t entrylo);
 
 /* Fields in the high-order word */
 #define TLBHI_VPAGE   0xfffff000
-/*      TLBHI_PID     0x00000fc0 */
+#define TLBHI_PID     0x00000fc0
+#define TLBHI_PIDSHIFT 6
+#define NUM_TLBPID    64
 
 /* Fields in the low-order word */
 #define TLBLO_PPAGE   0xfffff000
@@ -43,6 +43,7 @@
 #define DIRECTORY_PAGE_OFFSET 0x003FF000 /* mask for getting page number from directory vaddr */
 #define OFFSET_BITS 0x00000FFF /* mask for getting page offset from vaddr */
 
+#define COW_BIT 0x00000020 /* frame shared since fork: copy before writing */
 #define READ_BIT 0x00000010 /* mask for getting read bit from addr */
 #define WRITE_BIT 0x00000008 /* mask for getting write bit from addr */
 #define EXECUTE_BIT 0x00000004 /* mask for getting execute bit from addr */
@@ -125,16 +126,57 @@ paddr_t ram_getfirstfree(void);
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown names the page by ASID rather than address space, so the
+ * target never looks at an address space that may be gone by the time
+ * the interrupt arrives; ts_asidgen keeps it from dropping an entry of
+ * whoever holds the ASID in a later generation.
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_vaddr;	/* or TLBSHOOTDOWN_ASID for every page */
+	unsigned ts_asid;
+	unsigned ts_asidgen;
 };
 
+#define TLBSHOOTDOWN_ASID ((vaddr_t)-1)
+
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * Per-cpu free frame magazines.
+ *
+ * Each cpu caches up to CM_MAGAZINE_SIZE free frames, refilled from
+ * and drained back to the coremap CM_MAGAZINE_BATCH at a time.
+ */
+
+#define CM_MAGAZINE_SIZE 16
+#define CM_MAGAZINE_BATCH 8
+
+/*
+ * Per-cpu software TLB: a direct-mapped cache of recently loaded TLB
+ * entries, checked on a TLB miss before taking the paging lock and
+ * walking the page tables. A change to one mapping drops its entry on
+ * every cpu; an entry is also only good for the generation it was made
+ * in, and changes to a whole address space start a new one.
+ */
+
+#define VM_TLBCACHE_SIZE 256
+
+struct tlbcache_entry {
+	const void *tc_as;		/* address space it belongs to */
+	uint32_t tc_ehi;
+	uint32_t tc_elo;
+	unsigned tc_gen;
+};
+
+/*
+ * Page groups: while frames are plentiful, anonymous memory is filled
+ * VM_PGROUP_PAGES physically contiguous frames at a time, for groups
+ * aligned to VM_PGROUP_SIZE in the address space.
+ */
+
+#define VM_PGROUP_PAGES 4
+#define VM_PGROUP_SIZE (VM_PGROUP_PAGES * PAGE_SIZE)
+
 
 #endif /* _MIPS_VM_H_ */
@@ -30,6 +30,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/syscall.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <mips/trapframe.h>
 #include <thread.h>
@@ -120,6 +121,17 @@ syscall(struct trapframe *tf)
 			case SYS_sbrk:
 				err = sys_sbrk(&retval, (__intptr_t)tf->tf_a0);
 				break;
+			case SYS_mmap:
+				err = sys_mmap(&retval, (vaddr_t)tf->tf_a0,
+					       tf->tf_a1, tf->tf_a2, tf->tf_a3);
+				break;
+			case SYS_munmap:
+				err = sys_munmap((vaddr_t)tf->tf_a0, tf->tf_a1);
+				break;
+			case SYS_mprotect:
+				err = sys_mprotect((vaddr_t)tf->tf_a0, tf->tf_a1,
+						   tf->tf_a2);
+				break;
 
 
 	    default:
@@ -178,29 +190,58 @@ int sys_sbrk(vaddr_t *resultPtr, __intptr_t change)
 	if (change % PAGE_SIZE != 0)
 		return ENOSYS;
 
-	// lock up and check the addrspace values
-	spinlock_acquire(&curproc->p_lock);
-
-	struct addrspace *as = curproc->p_addrspace;
-	uint32_t temp = as->heapPtr + change;
+	struct addrspace *as = proc_getas();
+	vaddr_t oldHeap = as->heapPtr;
+	vaddr_t newHeap = oldHeap + change;
 
 	// keep out of the text region below the heap
-	if (temp <= as->textTopPtr)
+	if ((change < 0 && newHeap > oldHeap) || newHeap < as->textTopPtr)
 		return EINVAL;
 
 	// keep out of the stack region above the heap
-	if (temp >= as->stackPtr)
+	if ((change > 0 && newHeap < oldHeap) ||
+	    newHeap > as->stackPtr - VM_STACKPAGES * PAGE_SIZE)
+		return ENOMEM;
+
+	// and out of any mappings in between
+	if (change > 0 && as_range_mapped(as, oldHeap, newHeap))
 		return ENOMEM;
 
 	// we are OK - save the old heapPtr and update it
-	*resultPtr = (vaddr_t)PG_ADRS(as->heapPtr);
-	as->heapPtr += change;
+	*resultPtr = oldHeap;
+	as->heapPtr = newHeap;
+
+	// give back the pages (and page tables) of a shrunken heap
+	if (newHeap < oldHeap)
+		as_unmap_range(as, newHeap, oldHeap);
 
-	// unlock & return
-	spinlock_release(&curproc->p_lock);
 	return 0;
 }
 
+/*
+ * mmap's fd and offset come from the user stack, but only file mappings
+ * use them, and with no file table to find an fd's vnode in, every fd
+ * is bad.
+ */
+int sys_mmap(vaddr_t *resultPtr, vaddr_t addr, size_t len, int prot,
+	     int flags)
+{
+	if (!(flags & MAP_ANON))
+		return EBADF;
+
+	return as_mmap(proc_getas(), addr, len, prot, flags, resultPtr);
+}
+
+int sys_munmap(vaddr_t addr, size_t len)
+{
+	return as_munmap(proc_getas(), addr, len);
+}
+
+int sys_mprotect(vaddr_t addr, size_t len, int prot)
+{
+	return as_mprotect(proc_getas(), addr, len, prot);
+}
+
 void sys__exit(int status)
 {
 	saveStatus(curthread->t_name, status);
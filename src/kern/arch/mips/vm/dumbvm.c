@@ -126,6 +126,12 @@ free_kpages(vaddr_t addr)
 	(void)addr;
 }
 
+void
+vm_tlbshootdown_all(void)
+{
+	panic("dumbvm tried to do tlb shootdown?!\n");
+}
+
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
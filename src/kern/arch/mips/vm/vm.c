@@ -6,337 +6,2903 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <clock.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
+#include <synch.h>
+#include <thread.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <swap.h>
+#include <textcache.h>
 
 /*
  *
  */
 
-/* under dumbvm, always have 72k of user stack */
-/* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
-#define DUMBVM_STACKPAGES    18
-
 static struct coremap cm;
+static struct vm_stats vmstats;
+static struct cv *cleaner_cv;
 static unsigned vm_bootstrapped = 0;
+/* Current software TLB generation; starts above the cpus' zeroed ones */
+static volatile unsigned vm_tlbcache_gen = 1;
+/* ASID generation, likewise above the cpus' and address spaces' ones */
+static struct spinlock vm_asid_lock = SPINLOCK_INITIALIZER;
+static unsigned vm_asid_gen = 1;
+static unsigned vm_asid_next = 1;
+/* Cpus sent shootdowns not yet waited for; under the paging lock */
+static struct cpu *vm_shootdown_cpus[MAXCPUS];
+/* The shared zero frame, and the pre-zeroed frames (under cm_lock) */
+static paddr_t vm_zero_frame;
+static unsigned vm_zeroed[CM_ZERO_POOL];
+static unsigned vm_num_zeroed;
+/* Default resident set limit, and the working set sample generation and
+ * totals; under the paging lock
+ */
+static unsigned vm_rss_limit = CM_RSS_LIMIT;
+static unsigned vm_ws_gen = 1;
+static unsigned vm_ws_total;
+static unsigned vm_ws_spaces;
+static unsigned vm_ws_capacity;
+static unsigned vm_ws_pageins;
+/* Processes load control swapped out, oldest first, and where their
+ * faults wait; the load control tick (starting above the address
+ * spaces' zeroed ones), the address spaces that faulted in it and the
+ * clock counts at the last one; all under the paging lock
+ */
+static struct cv *vm_load_cv;
+static struct addrspace *vm_suspended[CM_MAX_SUSPENDED];
+static unsigned vm_num_suspended;
+/* The one being swapped out, until it is let back in or dies */
+static struct addrspace *vm_load_victim;
+static unsigned vm_load_ticks = 1;
+static unsigned vm_load_faulters;
+static unsigned vm_load_hardclocks;
+static unsigned vm_load_idleclocks;
+
+/* EntryHi PID field for an ASID */
+#define VM_TLBHI_ASID(asid) (((asid) << TLBHI_PIDSHIFT) & TLBHI_PID)
+
+/* Coremap index of the frame at pa */
+#define CM_IDX(pa) (((pa) - cm.first_mapped_paddr) / PAGE_SIZE)
 
 /*
  * Wrap ram_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
-void init_coremap(void) {
+/*
+ * Free run management. All free frames live in maximal runs of
+ * contiguous frames linked through their first frames, so taking a
+ * single frame is O(1), a multi-frame run is found by walking runs
+ * rather than frames, and freeing merges with both neighbors in O(1).
+ * Caller must hold cm_lock (or be initializing the coremap).
+ */
+static
+void
+cm_run_link(int start)
+{
+	struct coremap_entry *head = cm.entries + start;
 
-	spinlock_init(&cm.cm_lock);
+	head->prev_run = -1;
+	head->next_run = cm.free_runs;
+	if(cm.free_runs >= 0) {
+		(cm.entries + cm.free_runs)->prev_run = start;
+	}
+	cm.free_runs = start;
+}
 
-	cm.last_allocated = -1;
-	cm.oldest = -1;
+static
+void
+cm_run_unlink(int start)
+{
+	struct coremap_entry *head = cm.entries + start;
 
-	uint32_t memsize = ram_getsize();
-	unsigned max_coremap_entries = memsize / PAGE_SIZE;
-	cm.entries = (struct coremap_entry *)
-			  kmalloc(max_coremap_entries * sizeof(struct coremap_entry));
-	KASSERT(cm.entries);
-	/*
-	 * At this stage in the bootstrap process, kmalloc will be ram_steal()ing if
-	 * it needs a fresh page, meaning firstpaddr will be changing.
-	 * Our call to kmalloc for the coremap can cause the result of
-	 * ram_getsize() to change (if coremap allocation
-	 * cannot be handled by an existing subpage), so we call it again to
-	 * get the updated memsize. This works only because we modified
-	 * ram_getsize(), which wasn't being used by anything.
+	if(head->prev_run >= 0) {
+		(cm.entries + head->prev_run)->next_run = head->next_run;
+	} else {
+		KASSERT(cm.free_runs == start);
+		cm.free_runs = head->next_run;
+	}
+	if(head->next_run >= 0) {
+		(cm.entries + head->next_run)->prev_run = head->prev_run;
+	}
+	head->prev_run = -1;
+	head->next_run = -1;
+}
+
+/* Records that frames [start, start + len) form a run */
+static
+void
+cm_run_set(int start, int len)
+{
+	(cm.entries + start)->run_len = len;
+	(cm.entries + start + len - 1)->run_start = start;
+}
+
+/* Returns frames [start, start + npages) to the free runs */
+static
+void
+cm_free_run_insert(int start, int npages)
+{
+	int end = start + npages;
+
+	cm.num_free += npages;
+
+	/* Merge with the run ending just before us */
+	if(start > 0 && !(cm.entries + start - 1)->allocated) {
+		int left = (cm.entries + start - 1)->run_start;
+		cm_run_unlink(left);
+		npages += start - left;
+		start = left;
+	}
+	/* ...and with the run starting just after us */
+	if(end < (int) cm.num_frames && !(cm.entries + end)->allocated) {
+		int right_len = (cm.entries + end)->run_len;
+		cm_run_unlink(end);
+		(cm.entries + end)->run_len = 0;
+		npages += right_len;
+	}
+
+	cm_run_set(start, npages);
+	cm_run_link(start);
+}
+
+/*
+ * Takes npages contiguous free frames, returning the index of the
+ * first, or -1 if no run is long enough. Frames are carved off the
+ * end of a run so the run's head (and its list position) stays put.
+ * The frames are marked allocated before cm_lock is dropped so a
+ * concurrent free can't merge with them.
+ */
+static
+int
+cm_free_run_take(unsigned npages)
+{
+	int start, len, idx;
+	unsigned i;
+
+	if(npages > cm.num_free) {
+		return -1;
+	}
+
+	for(start = cm.free_runs; start >= 0;
+	    start = (cm.entries + start)->next_run) {
+		len = (cm.entries + start)->run_len;
+		if(len >= (int) npages) {
+			break;
+		}
+	}
+	if(start < 0) {
+		return -1;
+	}
+
+	idx = start + len - npages;
+	for(i = 0; i < npages; i++) {
+		(cm.entries + idx + i)->allocated = 1;
+	}
+	if(len == (int) npages) {
+		cm_run_unlink(start);
+		(cm.entries + start)->run_len = 0;
+	} else {
+		cm_run_set(start, len - npages);
+	}
+	cm.num_free -= npages;
+
+	return idx;
+}
+
+/*
+ * Per-cpu frame magazines. Frames sitting in a magazine stay marked
+ * allocated in the coremap; only their owning cpu touches them, with
+ * interrupts off so the thread can't be switched away mid-update.
+ * cm_lock is taken once per CM_MAGAZINE_BATCH frames moved.
+ *
+ * This only takes cm_lock off the allocation path. Giving a user
+ * frame an owner, or freeing it, still takes chain_lock once, for the
+ * policy hook and the owner's resident list; the list needs it even
+ * under policies whose hooks do nothing. Kernel frames skip it.
+ * Faults that miss the software TLB still serialize on the paging
+ * lock, which eviction holds across its swap write: a victim's pte is
+ * unmapped while it is written, and with the lock dropped its owner
+ * would take the page for untouched and zero-fill it.
+ */
+static
+void
+cm_magazine_refill(struct cpu *c)
+{
+	int idx;
+
+	spinlock_acquire(&cm.cm_lock);
+	while(c->c_numframes < CM_MAGAZINE_BATCH) {
+		idx = cm_free_run_take(1);
+		if(idx < 0) {
+			break;
+		}
+		c->c_frames[c->c_numframes++] = idx;
+	}
+	spinlock_release(&cm.cm_lock);
+}
+
+static
+void
+cm_magazine_drain(struct cpu *c, unsigned count)
+{
+	unsigned idx;
+
+	spinlock_acquire(&cm.cm_lock);
+	while(count > 0 && c->c_numframes > 0) {
+		idx = c->c_frames[--c->c_numframes];
+		(cm.entries + idx)->allocated = 0;
+		cm_free_run_insert(idx, 1);
+		count--;
+	}
+	spinlock_release(&cm.cm_lock);
+}
+
+/* Returns a free frame index from this cpu's magazine, or -1 */
+static
+int
+cm_magazine_get(void)
+{
+	int spl, idx = -1;
+	struct cpu *c;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if(c->c_numframes == 0) {
+		cm_magazine_refill(c);
+	}
+	if(c->c_numframes > 0) {
+		idx = c->c_frames[--c->c_numframes];
+	}
+	splx(spl);
+
+	return idx;
+}
+
+/* Hands a single (still marked allocated) frame to this cpu's magazine */
+static
+void
+cm_magazine_put(unsigned idx)
+{
+	int spl;
+	struct cpu *c;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+	if(c->c_numframes == CM_MAGAZINE_SIZE) {
+		cm_magazine_drain(c, CM_MAGAZINE_BATCH);
+	}
+	c->c_frames[c->c_numframes++] = idx;
+	splx(spl);
+}
+
+/* Gives this cpu's cached frames back so they can merge into runs */
+static
+void
+cm_magazine_flush(void)
+{
+	int spl;
+
+	spl = splhigh();
+	cm_magazine_drain(curcpu->c_self, CM_MAGAZINE_SIZE);
+	splx(spl);
+}
+
+/*
+ * Page replacement policies. The hooks run with chain_lock held,
+ * except rp_on_reference which is called on every TLB refill and so
+ * only sets per-frame bits. Only user frames that aren't being
+ * evicted are ever handed to a policy.
+ */
+
+static void vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr, bool wait);
+static void vm_tlbcache_drop(struct addrspace *as, vaddr_t vaddr);
+static void vm_tlbcache_insert(struct addrspace *as, vaddr_t vaddr,
+			       uint32_t elo);
+static void cm_rss_enforce(struct addrspace *as);
+
+/* True for frames the policy keeps track of: user frames with an
+ * owner, not being evicted
+ */
+static
+bool
+cm_in_policy(struct coremap_entry *entry)
+{
+	return entry->allocated && !entry->kern && !entry->busy &&
+		entry->pte != NULL;
+}
+
+/* True for frames a policy may choose as a victim: mapped once, if
+ * maybe held by the text cache too
+ */
+static
+bool
+cm_evictable(struct coremap_entry *entry)
+{
+	return cm_in_policy(entry) && !entry->cleaning &&
+		entry->refcount <= (entry->cached ? 2u : 1u);
+}
+
+/* True for frames that can be dropped without writing them anywhere */
+static
+bool
+cm_is_clean(struct coremap_entry *entry)
+{
+	return !entry->dirty && (entry->has_swap || entry->filebacked);
+}
+
+/*
+ * Clears a frame's referenced bit and drops its TLB entry so the
+ * next access refaults and sets the bit again.
+ */
+static
+void
+cm_clear_referenced(struct coremap_entry *entry)
+{
+	entry->referenced = 0;
+	vm_tlb_invalidate(entry->as, entry->vaddr, false);
+}
+
+static
+void
+cm_policy_noop(unsigned idx)
+{
+	(void)idx;
+}
+
+static
+void
+cm_policy_reference(unsigned idx)
+{
+	(cm.entries + idx)->referenced = 1;
+	(cm.entries + idx)->last_use = vmstats.vs_faults;
+}
+
+/* Policies without reference bits still date frames for working sets */
+static
+void
+cm_policy_stamp(unsigned idx)
+{
+	(cm.entries + idx)->last_use = vmstats.vs_faults;
+}
+
+/* Appends frame idx to the tail of the FIFO allocation chain.
+ * Caller must hold chain_lock.
+ */
+static
+void
+cm_chain_append(unsigned idx)
+{
+	if(cm.last_allocated >= 0) {
+		cm.entries[cm.last_allocated].next_allocated = idx;
+	}
+	if(cm.oldest < 0) {
+		cm.oldest = idx;
+	}
+	cm.entries[idx].prev_allocated = cm.last_allocated;
+	cm.entries[idx].next_allocated = -1;
+	cm.last_allocated = idx;
+}
+
+/* Unlinks frame idx from the FIFO allocation chain.
+ * Caller must hold chain_lock.
+ */
+static
+void
+cm_chain_remove(unsigned idx)
+{
+	struct coremap_entry *entry = cm.entries + idx;
+
+	/* If an entry was allocated before entry, set its
+	 * next_allocated to be entry's next_allocated
 	 */
-	memsize = ram_getsize();
-	/* num_frames will now track how many coremap entries to manage/allocate */
-	cm.num_frames = memsize / PAGE_SIZE;
-	cm.first_mapped_paddr = ram_getfirstfree();
+	if(entry->prev_allocated >= 0) {
+		/* Shouldn't be oldest if has prev_allocated */
+		KASSERT(cm.oldest != (int) idx);
+		(cm.entries + (entry->prev_allocated))->next_allocated
+			= entry->next_allocated;
+	} else {
+		/* Should be oldest if no prev_allocated */
+		KASSERT(cm.oldest == (int) idx);
+		cm.oldest = entry->next_allocated;
+	}
+	/* If an entry was allocated after entry, set its
+	 * prev_allocated to be entry's prev_allocated
+	 */
+	if(entry->next_allocated >= 0) {
+		/* Shouldn't be last_allocated if next allocated */
+		KASSERT(cm.last_allocated != (int) idx);
+		(cm.entries + (entry->next_allocated))->prev_allocated
+			= entry->prev_allocated;
+	} else {
+		/* Should be last_allocated if no next allocated */
+		KASSERT(cm.last_allocated == (int) idx);
+		cm.last_allocated = entry->prev_allocated;
+	}
+
+	entry->prev_allocated = -1;
+	entry->next_allocated = -1;
+}
+
+/* FIFO: evict the oldest evictable frame on the allocation chain,
+ * which also holds shared frames and those being cleaned
+ */
+static
+int
+cm_fifo_pick(unsigned *idxptr)
+{
+	int idx;
+
+	for(idx = cm.oldest; idx >= 0;
+	    idx = (cm.entries + idx)->next_allocated) {
+		if(cm_evictable(cm.entries + idx)) {
+			*idxptr = idx;
+			return 0;
+		}
+	}
+	return -1;
+}
 
+/*
+ * Clock (second chance). A frame referenced since the hand last
+ * passed is spared once. Two full turns always find a victim if any
+ * evictable frame exists.
+ */
+static
+int
+cm_clock_pick(unsigned *idxptr)
+{
+	unsigned scanned;
+	struct coremap_entry *entry;
+
+	for(scanned = 0; scanned < 2 * cm.num_frames; scanned++) {
+		entry = cm.entries + cm.clock_hand;
+		*idxptr = cm.clock_hand;
+		cm.clock_hand = (cm.clock_hand + 1) % cm.num_frames;
+
+		if(!cm_evictable(entry)) {
+			continue;
+		}
+		if(entry->referenced) {
+			cm_clear_referenced(entry);
+			continue;
+		}
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Aging LRU approximation. Every pick shifts each frame's referenced
+ * bit into the top of its 8-bit age and evicts the smallest age, i.e.
+ * the frame unreferenced for the most picks.
+ */
+static
+void
+cm_aging_alloc(unsigned idx)
+{
+	/* Just faulted in, so it counts as referenced now */
+	(cm.entries + idx)->age = 0x80;
+}
+
+static
+int
+cm_aging_pick(unsigned *idxptr)
+{
 	unsigned i;
+	int victim = -1;
+	struct coremap_entry *entry;
+
 	for(i = 0; i < cm.num_frames; i++) {
-		//(coremap.entries + i)->pte = NULL;
-		(cm.entries + i)->tlb_idx = -1;
-		(cm.entries + i)->prev_allocated = -1;
-		(cm.entries + i)->next_allocated = -1;
-		(cm.entries + i)->allocated = 0;
-		(cm.entries + i)->dirty = 0;
-		(cm.entries + i)->more_contig_frames = 0;
-		(cm.entries + i)->kern = 0;
+		entry = cm.entries + i;
+		if(!cm_evictable(entry)) {
+			continue;
+		}
+		entry->age = (entry->age >> 1) | (entry->referenced << 7);
+		if(entry->referenced) {
+			cm_clear_referenced(entry);
+		}
+		if(victim < 0 || entry->age < (cm.entries + victim)->age) {
+			victim = i;
+		}
+	}
+	if(victim < 0) {
+		return -1;
 	}
+	*idxptr = victim;
+	return 0;
 }
-void
-vm_bootstrap(void)
+
+/*
+ * WSClock. Like clock, but an unreferenced frame is only taken if it
+ * has fallen out of the working set: unused for more than
+ * CM_WSCLOCK_TAU faults of virtual time. Clean frames are preferred on
+ * the first turn. Failing that, the least recently used frame seen.
+ */
+static
+int
+cm_wsclock_pick(unsigned *idxptr)
 {
-	init_swapdisk();
-	init_coremap();
-	vm_bootstrapped = 1;
+	unsigned scanned;
+	int oldest = -1;
+	struct coremap_entry *entry;
+
+	for(scanned = 0; scanned < 2 * cm.num_frames; scanned++) {
+		entry = cm.entries + cm.clock_hand;
+		*idxptr = cm.clock_hand;
+		cm.clock_hand = (cm.clock_hand + 1) % cm.num_frames;
+
+		if(!cm_evictable(entry)) {
+			continue;
+		}
+		if(entry->referenced) {
+			cm_clear_referenced(entry);
+			entry->last_use = vmstats.vs_faults;
+			continue;
+		}
+		if(oldest < 0 ||
+		   entry->last_use < (cm.entries + oldest)->last_use) {
+			oldest = *idxptr;
+		}
+		if(vmstats.vs_faults - entry->last_use <= CM_WSCLOCK_TAU) {
+			continue;
+		}
+		if(entry->dirty && scanned < cm.num_frames) {
+			continue;
+		}
+		return 0;
+	}
+	if(oldest < 0) {
+		return -1;
+	}
+	*idxptr = oldest;
+	return 0;
+}
+
+/* Random: any evictable frame, found by probing from a random index */
+static
+int
+cm_random_pick(unsigned *idxptr)
+{
+	unsigned i, idx;
+
+	idx = random() % cm.num_frames;
+	for(i = 0; i < cm.num_frames; i++) {
+		if(cm_evictable(cm.entries + idx)) {
+			*idxptr = idx;
+			return 0;
+		}
+		idx = (idx + 1) % cm.num_frames;
+	}
+	return -1;
+}
+
+/* Indexed by the CM_REPLACE_* constants */
+static const struct cm_policy cm_policies[CM_NUM_POLICIES] = {
+	{ "fifo",    cm_chain_append, cm_policy_stamp,
+		     cm_chain_remove, cm_fifo_pick },
+	{ "clock",   cm_policy_noop,  cm_policy_reference,
+		     cm_policy_noop,  cm_clock_pick },
+	{ "lru",     cm_aging_alloc,  cm_policy_reference,
+		     cm_policy_noop,  cm_aging_pick },
+	{ "wsclock", cm_policy_reference, cm_policy_reference,
+		     cm_policy_noop,  cm_wsclock_pick },
+	{ "random",  cm_policy_noop,  cm_policy_stamp,
+		     cm_policy_noop,  cm_random_pick },
+};
+
+/*
+ * Switches replacement policy at runtime. Every frame the old policy
+ * tracks, shared and being cleaned included, is moved to the new
+ * one's bookkeeping in coremap order, so the FIFO chain is emptied on
+ * the way out and rebuilt from every owned frame on the way in.
+ */
+int
+cm_set_policy(const char *name)
+{
+	unsigned i;
+	const struct cm_policy *policy = NULL;
+
+	for(i = 0; i < CM_NUM_POLICIES; i++) {
+		if(!strcmp(name, cm_policies[i].rp_name)) {
+			policy = &cm_policies[i];
+		}
+	}
+	if(policy == NULL) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&cm.chain_lock);
+	for(i = 0; i < cm.num_frames; i++) {
+		if(cm_in_policy(cm.entries + i)) {
+			cm.policy->rp_on_free(i);
+			policy->rp_on_alloc(i);
+		}
+	}
+	cm.policy = policy;
+	spinlock_release(&cm.chain_lock);
+
+	return 0;
+}
+
+const char *
+cm_get_policy(void)
+{
+	return cm.policy->rp_name;
+}
+
+void
+vm_set_rss_limit(unsigned frames)
+{
+	vm_rss_limit = frames;
+}
+
+unsigned
+vm_get_rss_limit(void)
+{
+	return vm_rss_limit;
+}
+
+void init_coremap(void) {
+
+	spinlock_init(&cm.cm_lock);
+	spinlock_init(&cm.chain_lock);
+
+	cm.last_allocated = -1;
+	cm.oldest = -1;
+	cm.free_runs = -1;
+	cm.num_free = 0;
+	cm.clock_hand = 0;
+
+	uint32_t memsize = ram_getsize();
+	unsigned max_coremap_entries = memsize / PAGE_SIZE;
+	cm.entries = (struct coremap_entry *)
+			  kmalloc(max_coremap_entries * sizeof(struct coremap_entry));
+	KASSERT(cm.entries);
+	/*
+	 * At this stage in the bootstrap process, kmalloc will be ram_steal()ing if
+	 * it needs a fresh page, meaning firstpaddr will be changing.
+	 * Our call to kmalloc for the coremap can cause the result of
+	 * ram_getsize() to change (if coremap allocation
+	 * cannot be handled by an existing subpage), so we call it again to
+	 * get the updated memsize. This works only because we modified
+	 * ram_getsize(), which wasn't being used by anything.
+	 */
+	memsize = ram_getsize();
+	/* num_frames will now track how many coremap entries to manage/allocate */
+	cm.num_frames = memsize / PAGE_SIZE;
+	cm.first_mapped_paddr = ram_getfirstfree();
+
+	unsigned i;
+	for(i = 0; i < cm.num_frames; i++) {
+		(cm.entries + i)->pte = NULL;
+		(cm.entries + i)->as = NULL;
+		(cm.entries + i)->vaddr = 0;
+		(cm.entries + i)->tlb_idx = -1;
+		(cm.entries + i)->prev_allocated = -1;
+		(cm.entries + i)->next_allocated = -1;
+		(cm.entries + i)->rs_prev = -1;
+		(cm.entries + i)->rs_next = -1;
+		(cm.entries + i)->allocated = 0;
+		(cm.entries + i)->dirty = 0;
+		(cm.entries + i)->more_contig_frames = 0;
+		(cm.entries + i)->kern = 0;
+		(cm.entries + i)->busy = 0;
+		(cm.entries + i)->referenced = 0;
+		(cm.entries + i)->age = 0;
+		(cm.entries + i)->has_swap = 0;
+		(cm.entries + i)->cleaning = 0;
+		(cm.entries + i)->cached = 0;
+		(cm.entries + i)->last_use = 0;
+		(cm.entries + i)->swap_idx = 0;
+		(cm.entries + i)->run_len = 0;
+		(cm.entries + i)->run_start = -1;
+		(cm.entries + i)->prev_run = -1;
+		(cm.entries + i)->next_run = -1;
+	}
+
+	/* Everything starts out as one free run */
+	cm_free_run_insert(0, cm.num_frames);
+}
+static void vm_cleaner_thread(void *data1, unsigned long data2);
+static void vm_load_thread(void *data1, unsigned long data2);
+
+void
+vm_bootstrap(void)
+{
+	int result;
+
+	result = init_swapdisk();
+	if(result) {
+		/* Evictions find no free block and fail with ENOSPC */
+		kprintf("vm: no swap (%s), paging disabled\n",
+			strerror(result));
+	}
+	init_coremap();
+	vm_bootstrapped = 1;
+
+	/* kmalloc goes through the coremap from here on */
+	cm.policy = &cm_policies[CM_REPLACEMENT];
+	cm.paging_lock = lock_create("paging");
+	KASSERT(cm.paging_lock);
+
+	vm_zero_frame = getppages(NULL, 1);
+	KASSERT(vm_zero_frame != 0);
+	bzero((void *)PADDR_TO_KVADDR(vm_zero_frame), PAGE_SIZE);
+
+	cleaner_cv = cv_create("pagecleaner");
+	KASSERT(cleaner_cv);
+	vm_load_cv = cv_create("loadcontrol");
+	KASSERT(vm_load_cv);
+	result = thread_fork("pagecleaner", NULL, vm_cleaner_thread, NULL, 0);
+	if(result) {
+		panic("vm_bootstrap: can't start page cleaner: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("loadcontrol", NULL, vm_load_thread, NULL, 0);
+	if(result) {
+		panic("vm_bootstrap: can't start load control: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+cm_paging_acquire(void)
+{
+	lock_acquire(cm.paging_lock);
+}
+
+void
+cm_paging_release(void)
+{
+	lock_release(cm.paging_lock);
+}
+
+/*
+ * Check if we're in a context that can sleep. While most of the
+ * operations in dumbvm don't in fact sleep, in a real VM system many
+ * of them would. In those, assert that sleeping is ok. This helps
+ * avoid the situation where syscall-layer code that works ok with
+ * dumbvm starts blowing up during the VM assignment.
+ */
+static
+void
+vm_can_sleep(void)
+{
+	if (CURCPU_EXISTS()) {
+		/* must not hold spinlocks */
+		KASSERT(curcpu->c_spinlocks == 0);
+
+		/* must not be in an interrupt handler */
+		KASSERT(curthread->t_in_interrupt == 0);
+	}
+}
+
+/*
+ * Resident lists. Each address space links the frames it owns through
+ * their coremap entries, so looking over its own frames costs its
+ * resident set rather than the whole coremap. Caller holds chain_lock.
+ */
+static
+void
+cm_rs_insert(unsigned idx)
+{
+	struct coremap_entry *entry = cm.entries + idx;
+	struct addrspace *as = entry->as;
+
+	entry->rs_prev = -1;
+	entry->rs_next = as->rsFirst;
+	if(as->rsFirst >= 0) {
+		(cm.entries + as->rsFirst)->rs_prev = idx;
+	}
+	as->rsFirst = idx;
+}
+
+static
+void
+cm_rs_remove(unsigned idx)
+{
+	struct coremap_entry *entry = cm.entries + idx;
+
+	if(entry->rs_prev >= 0) {
+		(cm.entries + entry->rs_prev)->rs_next = entry->rs_next;
+	} else {
+		entry->as->rsFirst = entry->rs_next;
+	}
+	if(entry->rs_next >= 0) {
+		(cm.entries + entry->rs_next)->rs_prev = entry->rs_prev;
+	}
+	entry->rs_prev = -1;
+	entry->rs_next = -1;
+}
+
+/*
+ * Makes the frames from idx on the user pages from vaddr on. User runs
+ * map consecutive pages through consecutive ptes, but each frame is its
+ * own page from here on.
+ */
+static
+void
+cm_set_owner(unsigned idx, struct addrspace *as, vaddr_t vaddr,
+	     pageTableEntry_t *pte, unsigned npages)
+{
+	struct coremap_entry *entry = cm.entries + idx;
+	unsigned j;
+
+	for(j = 0; j < npages; j++) {
+		/* Set entry owner. No swap copy yet, so dirty */
+		(entry + j)->kern = 0;
+		(entry + j)->pte = pte + j;
+		(entry + j)->as = as;
+		(entry + j)->vaddr = vaddr + j * PAGE_SIZE;
+		(entry + j)->dirty = 1;
+		(entry + j)->has_swap = 0;
+		(entry + j)->cleaning = 0;
+		(entry + j)->refcount = 1;
+		(entry + j)->filebacked = 0;
+		(entry + j)->cached = 0;
+		(entry + j)->last_use = vmstats.vs_faults;
+	}
+	as->rss += npages;
+
+	/* Hand the frames to the replacement policy */
+	spinlock_acquire(&cm.chain_lock);
+	for(j = 0; j < npages; j++) {
+		cm_rs_insert(idx + j);
+		cm.policy->rp_on_alloc(idx + j);
+	}
+	spinlock_release(&cm.chain_lock);
+}
+
+/* Used to get npages physical pages for kernel allocation,
+ * or 1 page for non-kernel allocation. If kernel pages,
+ * pte should be NULL.
+ */
+static
+paddr_t
+cm_getppages(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *pte,
+	     unsigned long npages)
+{
+	paddr_t addr;
+	/* Before vm_bootstrapped, we are stealing ram. After, coremap manages mem */
+	if(vm_bootstrapped) {
+
+		unsigned j;
+		int entry_idx;
+
+		if(npages == 1) {
+			entry_idx = cm_magazine_get();
+		} else {
+			spinlock_acquire(&cm.cm_lock);
+			entry_idx = cm_free_run_take(npages);
+			spinlock_release(&cm.cm_lock);
+
+			/* Frames cached here may be what splits the run */
+			if(entry_idx < 0) {
+				cm_magazine_flush();
+				spinlock_acquire(&cm.cm_lock);
+				entry_idx = cm_free_run_take(npages);
+				spinlock_release(&cm.cm_lock);
+			}
+		}
+		/* No free frames found */
+		if(entry_idx < 0) {
+			return 0;
+		}
+
+		struct coremap_entry *return_entry;
+		return_entry = (cm.entries + entry_idx);
+
+		/* Only kernel pages have no pte */
+		if(!pte) {
+			for(j = 0; j < npages; j++) {
+				(return_entry + j)->kern = 1;
+				if(j < npages - 1) {
+					(return_entry + j)->more_contig_frames = 1;
+				}
+			}
+		} else {
+			cm_set_owner(entry_idx, as, vaddr, pte, npages);
+		}
+
+		addr = cm.first_mapped_paddr + (entry_idx * PAGE_SIZE);
+
+	} else {
+		spinlock_acquire(&stealmem_lock);
+
+		addr = ram_stealmem(npages);
+
+		spinlock_release(&stealmem_lock);
+	}
+	return addr;
+}
+
+paddr_t
+getppages(pageTableEntry_t *pte, unsigned long npages)
+{
+	return cm_getppages(NULL, 0, pte, npages);
+}
+
+/* wrapper to assume 1 page */
+paddr_t cm_alloc_frame(struct addrspace *as, vaddr_t vaddr,
+		       pageTableEntry_t *pte)
+{
+	return cm_getppages(as, vaddr, pte, 1);
+}
+
+paddr_t
+cm_alloc_frame_evict(struct addrspace *as, vaddr_t vaddr,
+		     pageTableEntry_t *pte)
+{
+	paddr_t pa;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	cm_rss_enforce(as);
+	pa = cm_alloc_frame(as, vaddr, pte);
+	while(pa == 0) {
+		if(evict_frame()) {
+			return 0;
+		}
+		pa = cm_alloc_frame(as, vaddr, pte);
+	}
+	return pa;
+}
+
+/*
+ * Pushes one user frame out to swap to make room for a kernel
+ * allocation. The paging lock may already be held if the allocation
+ * comes from inside the fault path (e.g. a new page table).
+ */
+static
+int
+cm_make_room(void)
+{
+	int result;
+	bool held = lock_do_i_hold(cm.paging_lock);
+
+	if(!held) {
+		lock_acquire(cm.paging_lock);
+	}
+	result = evict_frame();
+	if(!held) {
+		lock_release(cm.paging_lock);
+	}
+	return result;
+}
+
+/* Allocate/free some kernel-space virtual pages */
+vaddr_t
+alloc_kpages(unsigned npages)
+{
+	paddr_t pa;
+	vm_can_sleep();
+	/* Get npages for kernel */
+	pa = getppages(NULL, npages);
+	/* Out of free frames: push user pages to swap until the run fits */
+	while (pa==0 && cm.paging_lock != NULL) {
+		if (cm_make_room()) {
+			return 0;
+		}
+		pa = getppages(NULL, npages);
+	}
+	if (pa==0) {
+		return 0;
+	}
+	return PADDR_TO_KVADDR(pa);
+}
+
+void
+free_kpages(vaddr_t addr)
+{
+	/* Pages stolen before the coremap existed can't be given back */
+	if(vm_bootstrapped && KVADDR_TO_PADDR(addr) >= cm.first_mapped_paddr) {
+		cm_free_frames(KVADDR_TO_PADDR(addr));
+	}
+}
+
+int
+cm_free_frames(paddr_t pa)
+{
+	unsigned cm_idx;
+	/* pa guaranteed to be page aligned, so truncation should not be
+	 * a concern here.
+	 */
+	KASSERT(pa >= cm.first_mapped_paddr);
+	KASSERT(pa % PAGE_SIZE == 0);
+	cm_idx = (pa - cm.first_mapped_paddr) / PAGE_SIZE;
+
+	/* verify within coremap bounds */
+	KASSERT(cm_idx < cm.num_frames);
+
+	struct coremap_entry *to_free;
+	int more_to_free = 1;
+	unsigned first_idx = cm_idx;
+	bool was_cleaning;
+
+	/* Take the frame from the replacement policy (only applicable
+	 * to non-kernel frames; frames being evicted already left it)
+	 */
+	to_free = (cm.entries + cm_idx);
+	if(!to_free->kern) {
+		spinlock_acquire(&cm.chain_lock);
+		if(!to_free->busy && to_free->pte != NULL) {
+			cm.policy->rp_on_free(cm_idx);
+		}
+		if(to_free->as != NULL) {
+			cm_rs_remove(cm_idx);
+		}
+		to_free->busy = 0;
+		/* tells the cleaner its write is no longer wanted */
+		was_cleaning = to_free->cleaning;
+		to_free->cleaning = 0;
+		spinlock_release(&cm.chain_lock);
+
+		/* The page is gone, so is its swap copy. A block the
+		 * cleaner is still writing is released by the cleaner.
+		 */
+		if(to_free->has_swap && !was_cleaning) {
+			clear_map_block(to_free->swap_idx);
+		}
+		to_free->has_swap = 0;
+		to_free->dirty = 0;
+		to_free->refcount = 0;
+		to_free->filebacked = 0;
+		to_free->cached = 0;
+	}
+
+	while(more_to_free) {
+		to_free = (cm.entries + cm_idx);
+
+		if(to_free->as != NULL) {
+			to_free->as->rss--;
+		}
+		to_free->pte = NULL;
+		to_free->as = NULL;
+		to_free->vaddr = 0;
+		to_free->tlb_idx = -1;
+		to_free->kern = 0;
+		to_free->referenced = 0;
+
+		more_to_free = to_free->more_contig_frames;
+		to_free->more_contig_frames = 0;
+
+		cm_idx++;
+	}
+
+	/* Single frames go to this cpu's magazine, runs straight back */
+	if(cm_idx - first_idx == 1) {
+		cm_magazine_put(first_idx);
+		return 0;
+	}
+
+	spinlock_acquire(&cm.cm_lock);
+
+	for(to_free = cm.entries + first_idx;
+	    to_free < cm.entries + cm_idx; to_free++) {
+		to_free->allocated = 0;
+	}
+	cm_free_run_insert(first_idx, cm_idx - first_idx);
+
+	spinlock_release(&cm.cm_lock);
+
+	return 0;
+}
+
+/*
+ * Copy-on-write. After fork both page tables map the same frames, with
+ * COW_BIT set, and each frame counts its mappings in refcount. A frame
+ * keeps its reverse map (pte/as/vaddr) only while that mapping lives;
+ * once the recorded owner lets go the frame is orphaned: it leaves the
+ * replacement policy until a last remaining mapper claims it back.
+ * Shared frames are never evicted, since only one pte could be updated.
+ * The exception is a text page mapped by its owner and held by the
+ * text cache: the cache lets go of it first. So the text of a program
+ * one process runs pages like the rest of it; text several processes
+ * map stays resident until the cache gives it up.
+ * The zero frame is a kernel frame that any number of ptes map; it is
+ * never counted.
+ */
+void
+cm_share_frame(pageTableEntry_t pte)
+{
+	struct coremap_entry *entry = cm.entries + CM_IDX(PG_ADRS(pte));
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+	if(PG_ADRS(pte) == vm_zero_frame) {
+		return;
+	}
+	KASSERT(!entry->kern && entry->refcount > 0);
+	entry->refcount++;
+}
+
+/* Forgets the recorded owner of a still shared frame */
+static
+void
+cm_orphan_frame(unsigned idx)
+{
+	struct coremap_entry *entry = cm.entries + idx;
+
+	spinlock_acquire(&cm.chain_lock);
+	KASSERT(!entry->busy);
+	cm.policy->rp_on_free(idx);
+	cm_rs_remove(idx);
+	entry->as->rss--;
+	entry->pte = NULL;
+	entry->as = NULL;
+	entry->vaddr = 0;
+	spinlock_release(&cm.chain_lock);
+}
+
+void
+cm_unmap_frame(pageTableEntry_t *pte)
+{
+	unsigned idx = CM_IDX(PG_ADRS(*pte));
+	struct coremap_entry *entry = cm.entries + idx;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	if(PG_ADRS(*pte) == vm_zero_frame) {
+		return;
+	}
+	if(entry->refcount > 1) {
+		entry->refcount--;
+		if(entry->pte == pte) {
+			cm_orphan_frame(idx);
+		}
+		return;
+	}
+	cm_free_frames(PG_ADRS(*pte));
+}
+
+unsigned
+cm_frame_refcount(paddr_t pa)
+{
+	return (cm.entries + CM_IDX(pa))->refcount;
+}
+
+void
+cm_cache_frame(paddr_t pa)
+{
+	struct coremap_entry *entry = cm.entries + CM_IDX(pa);
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+	KASSERT(!entry->kern && !entry->cached && entry->refcount > 0);
+	entry->refcount++;
+	entry->cached = 1;
+}
+
+void
+cm_release_frame(paddr_t pa)
+{
+	struct coremap_entry *entry = cm.entries + CM_IDX(pa);
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	entry->cached = 0;
+	if(entry->refcount > 1) {
+		entry->refcount--;
+		return;
+	}
+	/* Only page tables are recorded as owners */
+	KASSERT(entry->pte == NULL);
+	cm_free_frames(pa);
+}
+
+void
+cm_mark_filebacked(paddr_t pa)
+{
+	struct coremap_entry *entry = cm.entries + CM_IDX(pa);
+
+	entry->filebacked = 1;
+	entry->dirty = 0;
+}
+
+/* The victim leaves the policy until it's freed or requeued. Caller
+ * must hold chain_lock.
+ */
+static
+void
+cm_take_frame(unsigned idx)
+{
+	cm.policy->rp_on_free(idx);
+	(cm.entries + idx)->busy = 1;
+}
+
+int select_victim(unsigned *idxptr) {
+
+	spinlock_acquire(&cm.chain_lock);
+
+	if(cm.policy->rp_pick_victim(idxptr)) {
+		spinlock_release(&cm.chain_lock);
+		DEBUG(DB_VM, "vm: no eviction victim\n");
+		return -1;
+	}
+
+	cm_take_frame(*idxptr);
+
+	spinlock_release(&cm.chain_lock);
+	return 0;
+}
+
+/* Puts a victim whose eviction failed back on the allocation chain */
+static
+void
+cm_requeue_frame(unsigned idx)
+{
+	spinlock_acquire(&cm.chain_lock);
+	(cm.entries + idx)->busy = 0;
+	cm.policy->rp_on_alloc(idx);
+	spinlock_release(&cm.chain_lock);
+}
+
+void
+cm_io_begin(paddr_t pa)
+{
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	spinlock_acquire(&cm.chain_lock);
+	cm_take_frame(CM_IDX(pa));
+	spinlock_release(&cm.chain_lock);
+	lock_release(cm.paging_lock);
+}
+
+void
+cm_io_end(paddr_t pa)
+{
+	lock_acquire(cm.paging_lock);
+	cm_requeue_frame(CM_IDX(pa));
+}
+
+/* Drops this cpu's TLB entry for vaddr under asid; call at splhigh */
+static
+void
+vm_tlb_invalidate_local(unsigned asid, vaddr_t vaddr)
+{
+	int idx;
+
+	idx = tlb_probe(vaddr | VM_TLBHI_ASID(asid), 0);
+	if(idx >= 0) {
+		tlb_write(TLBHI_INVALID(idx) | VM_TLBHI_ASID(curcpu->c_asid),
+			  TLBLO_INVALID(), idx);
+	} else if(asid != curcpu->c_asid) {
+		/* The probe left the other ASID in EntryHi; put ours back */
+		tlb_probe(TLBHI_INVALID(0) | VM_TLBHI_ASID(curcpu->c_asid), 0);
+	}
+}
+
+/* Drops every entry this cpu's TLB holds under asid; call at splhigh */
+static
+void
+vm_tlb_flush_asid(unsigned asid)
+{
+	uint32_t ehi, elo;
+	int i;
+
+	for(i = 0; i < NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if((ehi & TLBHI_PID) == VM_TLBHI_ASID(asid)) {
+			tlb_write(TLBHI_INVALID(i) |
+				  VM_TLBHI_ASID(curcpu->c_asid),
+				  TLBLO_INVALID(), i);
+		}
+	}
+	/* The reads left the last entry's ASID in EntryHi */
+	tlb_probe(TLBHI_INVALID(0) | VM_TLBHI_ASID(curcpu->c_asid), 0);
+}
+
+/*
+ * Drops the TLB entry for vaddr in the address space. Entries stay
+ * resident across context switches, but only on the cpu the address
+ * space last took its ASID on, so the entry is either dropped right
+ * here or shot down on that one cpu. With wait set the caller must
+ * hold the paging lock and call vm_tlb_shootdown_wait before reusing
+ * the frame; pages invalidated in between share one wait, and the
+ * target handles the batch in one interrupt. Without it the shootdown
+ * is fire and forget, which is all clearing a referenced bit needs.
+ */
+static
+void
+vm_tlb_invalidate(struct addrspace *as, vaddr_t vaddr, bool wait)
+{
+	struct tlbshootdown ts;
+	struct cpu *target;
+
+	KASSERT(!wait || lock_do_i_hold(cm.paging_lock));
+
+	/* Any cpu may have it cached, whichever address space it is */
+	vm_tlbcache_drop(as, vaddr);
+
+	spinlock_acquire(&vm_asid_lock);
+	target = as->asidCpu;
+	ts.ts_vaddr = vaddr & PAGE_FRAME;
+	ts.ts_asid = as->asid;
+	ts.ts_asidgen = as->asidGen;
+	if(target == curcpu) {
+		if(ts.ts_asidgen == curcpu->c_asidgen) {
+			vm_tlb_invalidate_local(ts.ts_asid, ts.ts_vaddr);
+		}
+		target = NULL;
+	}
+	spinlock_release(&vm_asid_lock);
+
+	/* Never ran anywhere else, or has since dropped that ASID */
+	if(target == NULL || ts.ts_asidgen == 0) {
+		return;
+	}
+
+	ipi_tlbshootdown(target, &ts);
+	vmstats.vs_shootdowns++;
+	if(wait) {
+		vm_shootdown_cpus[target->c_number] = target;
+	}
+}
+
+/* Waits out the shootdowns sent since the last wait */
+static
+void
+vm_tlb_shootdown_wait(void)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	for(i = 0; i < MAXCPUS; i++) {
+		if(vm_shootdown_cpus[i] != NULL) {
+			ipi_tlbshootdown_wait(vm_shootdown_cpus[i]);
+			vm_shootdown_cpus[i] = NULL;
+		}
+	}
+}
+
+/*
+ * Where the page at va should go on swap: the block at its slot in the
+ * stripe of a neighbour in the same aligned run of SWAP_STRIPE pages,
+ * if one sits at its own slot (on disk, or resident with a swap copy).
+ * See swap.h.
+ */
+static
+void
+vm_swap_hint(struct addrspace *as, vaddr_t va, struct swap_hint *hint)
+{
+	pageTableEntry_t *pte;
+	struct coremap_entry *entry;
+	vaddr_t base;
+	unsigned i, block;
+
+	hint->sh_slot = (va / PAGE_SIZE) % SWAP_STRIPE;
+	hint->sh_block = SWAP_NOBLOCK;
+
+	base = va - hint->sh_slot * PAGE_SIZE;
+	for(i = 0; i < SWAP_STRIPE; i++) {
+		if(i == hint->sh_slot || base + i * PAGE_SIZE >= USERSPACETOP) {
+			continue;
+		}
+		pte = as_lookup_pte(as, base + i * PAGE_SIZE, false);
+		if(pte == NULL) {
+			continue;
+		}
+		if(IS_ON_DISK(*pte)) {
+			block = PTE_SWAP_BLOCK(*pte);
+		} else if(IS_USED_PAGE(*pte) &&
+			  PG_ADRS(*pte) != vm_zero_frame) {
+			entry = cm.entries + CM_IDX(PG_ADRS(*pte));
+			if(!entry->has_swap) {
+				continue;
+			}
+			block = entry->swap_idx;
+		} else {
+			continue;
+		}
+		if(block % SWAP_STRIPE == i) {
+			hint->sh_block = block - i + hint->sh_slot;
+			return;
+		}
+	}
+}
+
+/*
+ * Swap clustering. A victim with no swap copy is written together with
+ * the dirty resident pages right around it in its address space, into
+ * contiguous blocks of one stripe, in a single disk request. The
+ * neighbours stay resident but are now clean, so evicting them later
+ * costs nothing; sequential workloads end up writing whole runs.
+ */
+
+/* Coremap index of the page at va if it can join a swap-out cluster */
+static
+int
+vm_cluster_out_candidate(struct addrspace *as, vaddr_t va)
+{
+	pageTableEntry_t *pte;
+	struct coremap_entry *entry;
+
+	if(va >= USERSPACETOP) {
+		return -1;
+	}
+	pte = as_lookup_pte(as, va, false);
+	if(pte == NULL || !IS_USED_PAGE(*pte)) {
+		return -1;
+	}
+	entry = cm.entries + CM_IDX(PG_ADRS(*pte));
+	if(!cm_evictable(entry) || entry->has_swap || cm_is_clean(entry)) {
+		return -1;
+	}
+	return entry - cm.entries;
+}
+
+/*
+ * Writes the (already unmapped) victim at pa to swap along with its
+ * neighbours, storing the victim's block in blockptr. Falls back to a
+ * lone swap_out when there are no neighbours or no cluster of blocks.
+ * Caller holds the paging lock.
+ */
+static
+int
+vm_swap_out_cluster(struct coremap_entry *victim, paddr_t pa,
+		    unsigned *blockptr)
+{
+	paddr_t pas[SWAP_CLUSTER];
+	int idxs[SWAP_CLUSTER];
+	unsigned i, b, f, n, first;
+	struct swap_hint hint;
+	vaddr_t va;
+	int result, idx;
+
+	/* How far the run reaches below and above the victim */
+	for(b = 0; b + 1 < SWAP_CLUSTER; b++) {
+		if(victim->vaddr < (b + 1) * PAGE_SIZE ||
+		   vm_cluster_out_candidate(victim->as,
+			   victim->vaddr - (b + 1) * PAGE_SIZE) < 0) {
+			break;
+		}
+	}
+	for(f = 0; b + f + 1 < SWAP_CLUSTER; f++) {
+		if(vm_cluster_out_candidate(victim->as,
+			   victim->vaddr + (f + 1) * PAGE_SIZE) < 0) {
+			break;
+		}
+	}
+	n = b + f + 1;
+
+	va = victim->vaddr - b * PAGE_SIZE;
+	vm_swap_hint(victim->as, va, &hint);
+	if(n == 1 || get_free_cluster(n, &hint, &first)) {
+		vm_swap_hint(victim->as, victim->vaddr, &hint);
+		return swap_out(pa, &hint, blockptr);
+	}
+
+	for(i = 0; i < n; i++, va += PAGE_SIZE) {
+		if(i == b) {
+			idxs[i] = -1;
+			pas[i] = pa;
+			continue;
+		}
+		idx = vm_cluster_out_candidate(victim->as, va);
+		KASSERT(idx >= 0);
+		idxs[i] = idx;
+		pas[i] = cm.first_mapped_paddr + idx * PAGE_SIZE;
+
+		/* Clean from here on: a write now refaults and redirties */
+		(cm.entries + idx)->dirty = 0;
+		vm_tlb_invalidate(victim->as, va, true);
+	}
+	vm_tlb_shootdown_wait();
+
+	result = swap_write_cluster(pas, n, first);
+
+	for(i = 0; i < n; i++) {
+		if(result) {
+			clear_map_block(first + i);
+			if(idxs[i] >= 0) {
+				(cm.entries + idxs[i])->dirty = 1;
+			}
+		} else if(idxs[i] >= 0) {
+			(cm.entries + idxs[i])->swap_idx = first + i;
+			(cm.entries + idxs[i])->has_swap = 1;
+			vmstats.vs_clustered++;
+		}
+	}
+	if(result) {
+		return result;
+	}
+
+	*blockptr = first + b;
+	cm_free_frames(pa);
+
+	return 0;
+}
+
+/*
+ * Zero pages. A read of an untouched anonymous page maps the one shared
+ * zero frame, copy-on-write, so memory that is only ever read costs no
+ * frame at all; the first write gives the page a frame of its own. Those
+ * frames come zeroed from a pool the cleaner fills while it is idle, so
+ * the fault doesn't pay for the zeroing either. Pooled frames are kernel
+ * frames until handed out, and go back to the coremap under pressure.
+ */
+static
+void
+vm_zero_pool_fill(void)
+{
+	paddr_t pa;
+
+	while(vm_num_zeroed < CM_ZERO_POOL && cm.num_free > CM_CLEAN_TARGET) {
+		pa = getppages(NULL, 1);
+		if(pa == 0) {
+			return;
+		}
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+		spinlock_acquire(&cm.cm_lock);
+		vm_zeroed[vm_num_zeroed++] = CM_IDX(pa);
+		spinlock_release(&cm.cm_lock);
+	}
+}
+
+/* Takes a pooled frame; -1 if the pool is empty */
+static
+int
+vm_zero_pool_take(void)
+{
+	int idx = -1;
+
+	spinlock_acquire(&cm.cm_lock);
+	if(vm_num_zeroed > 0) {
+		idx = vm_zeroed[--vm_num_zeroed];
+	}
+	spinlock_release(&cm.cm_lock);
+	return idx;
+}
+
+/* Gives a pooled frame back to the coremap; false if there were none */
+static
+bool
+vm_zero_pool_drain(void)
+{
+	int idx = vm_zero_pool_take();
+
+	if(idx < 0) {
+		return false;
+	}
+	cm_free_frames(cm.first_mapped_paddr + idx * PAGE_SIZE);
+	return true;
+}
+
+/* A zeroed frame for the page, from the pool if it can. Caller holds
+ * the paging lock.
+ */
+static
+paddr_t
+vm_alloc_zeroed(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *pte)
+{
+	paddr_t pa;
+	int idx;
+
+	idx = vm_zero_pool_take();
+	if(idx >= 0) {
+		/* cm_alloc_frame_evict does this on the other path */
+		cm_rss_enforce(as);
+		cm_set_owner(idx, as, vaddr, pte, 1);
+		pa = cm.first_mapped_paddr + idx * PAGE_SIZE;
+		vmstats.vs_prezeroed++;
+	} else {
+		pa = cm_alloc_frame_evict(as, vaddr, pte);
+		if(pa == 0) {
+			return 0;
+		}
+		bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+	}
+
+	if(vm_num_zeroed < CM_ZERO_POOL / 2) {
+		cv_signal(cleaner_cv, cm.paging_lock);
+	}
+	vmstats.vs_zerofills++;
+	return pa;
+}
+
+/*
+ * Evicts the frame select_victim (or cm_pick_local) took off the
+ * replacement policy: writes it to swap if it has to, points its pte
+ * at the swap block and frees the frame.
+ */
+static
+int
+cm_evict(unsigned frame_idx)
+{
+	int result;
+	unsigned swap_idx;
+	struct coremap_entry *victim;
+	pageTableEntry_t *pte, old_pte;
+
+	victim = cm.entries + frame_idx;
+	KASSERT(!victim->cleaning);
+	pte = victim->pte;
+	old_pte = *pte;
+
+	/* first_mapped_paddr won't be changing at this point: lock unnecessary */
+	paddr_t pa;
+	pa = frame_idx * PAGE_SIZE + cm.first_mapped_paddr;
+	KASSERT(IS_USED_PAGE(old_pte) && PG_ADRS(old_pte) == pa);
+
+	/* Unmap before writing so the owner refaults (and waits for the
+	 * paging lock) instead of writing to the frame mid swap-out.
+	 */
+	*pte = PTE_PERMS(old_pte);
+	vm_tlb_invalidate(victim->as, victim->vaddr, true);
+	vm_tlb_shootdown_wait();
+
+	if(victim->cached) {
+		KASSERT(victim->filebacked && !victim->dirty);
+		textcache_forget(pa);
+	}
+	if(victim->filebacked && !victim->dirty) {
+		/* Unmodified page of the executable: leave the pte unmapped
+		 * and the fault handler will read it in again.
+		 */
+		cm_free_frames(pa);
+		vmstats.vs_clean_evictions++;
+		vmstats.vs_evictions++;
+		return 0;
+	} else if(victim->has_swap && !victim->dirty) {
+		/* Unmodified since swapped in or cleaned: drop the frame,
+		 * keep the swap copy.
+		 */
+		swap_idx = victim->swap_idx;
+		victim->has_swap = 0;
+		cm_free_frames(pa);
+		vmstats.vs_clean_evictions++;
+	} else if(victim->has_swap) {
+		/* Stale copy: rewrite it in place rather than take a block */
+		swap_idx = victim->swap_idx;
+		result = write_frame(pa, (off_t) swap_idx);
+
+		if(result) {
+			*pte = old_pte;
+			cm_requeue_frame(frame_idx);
+			return result;
+		}
+		victim->has_swap = 0;
+		cm_free_frames(pa);
+	} else {
+		result = vm_swap_out_cluster(victim, pa, &swap_idx);
+		/* Swap may only be full of blocks waiting to be scrubbed */
+		if(result && swap_scrub(SWAP_SCRUB_BATCH) > 0) {
+			result = swap_out(pa, NULL, &swap_idx);
+		}
+
+		if(result) {
+			/* Because failure, map the frame again */
+			*pte = old_pte;
+			cm_requeue_frame(frame_idx);
+			return result;
+		}
+	}
+
+	*pte = MAKE_SWAP_PTE(swap_idx, PTE_PERMS(old_pte));
+	vmstats.vs_evictions++;
+
+	return 0;
+}
+
+int evict_frame(void) {
+	int result;
+	unsigned frame_idx;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	/* Text pages no process is running, and spare page tables, are
+	 * free to give up.
+	 */
+	if(textcache_reclaim(false) || as_pt_reclaim() ||
+	   vm_zero_pool_drain()) {
+		return 0;
+	}
+
+	result = select_victim(&frame_idx);
+	if(result) {
+		/* Maybe all that's left is text the cache keeps shared */
+		if(textcache_reclaim(true)) {
+			return 0;
+		}
+		return result;
+	}
+
+	return cm_evict(frame_idx);
+}
+
+/*
+ * Resident set limits. An address space at its limit gets no more
+ * frames from everyone else: each page it brings in evicts one of its
+ * own first, the one it used longest ago (frames the clock policies
+ * find referenced refault and are redated). Shared frames can't be
+ * evicted, so a process whose frames are all shared grows past its
+ * limit rather than fail.
+ */
+static
+int
+cm_pick_local(struct addrspace *as, unsigned *idxptr)
+{
+	int i, victim = -1;
+	struct coremap_entry *entry;
+
+	spinlock_acquire(&cm.chain_lock);
+	for(i = as->rsFirst; i >= 0; i = entry->rs_next) {
+		entry = cm.entries + i;
+		if(!cm_evictable(entry)) {
+			continue;
+		}
+		if(victim < 0 ||
+		   entry->last_use < (cm.entries + victim)->last_use) {
+			victim = i;
+		}
+	}
+	if(victim < 0) {
+		spinlock_release(&cm.chain_lock);
+		return -1;
+	}
+
+	*idxptr = victim;
+	cm_take_frame(victim);
+	spinlock_release(&cm.chain_lock);
+	return 0;
+}
+
+/* Frames as may still take before it reaches its limit */
+static
+unsigned
+cm_rss_room(struct addrspace *as)
+{
+	if(as->rssLimit == 0) {
+		return cm.num_frames;
+	}
+	return as->rss < as->rssLimit ? as->rssLimit - as->rss : 0;
+}
+
+/* Makes room under as's limit for one more frame, if it can */
+static
+void
+cm_rss_enforce(struct addrspace *as)
+{
+	unsigned idx;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	if(cm_rss_room(as) > 0 || cm_pick_local(as, &idx)) {
+		return;
+	}
+	if(cm_evict(idx) == 0) {
+		vmstats.vs_local_evictions++;
+	}
+}
+
+/*
+ * Working set sampling. Every load control tick, counts for each
+ * address space with frames those it used within the last
+ * CM_WSCLOCK_TAU faults. Frames are dated on every TLB refill; the
+ * clock policies clear reference bits by dropping TLB entries, so a
+ * page in use keeps refaulting and stays dated. Address spaces that
+ * own no frames aren't seen and keep a stale sample, as do suspended
+ * ones, whose sample is what they need to be let back in. Returns the
+ * running address space with the largest resident set, if any.
+ */
+static
+struct addrspace *
+vm_ws_sample(void)
+{
+	unsigned i;
+	struct coremap_entry *entry;
+	struct addrspace *as, *largest = NULL;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	vm_ws_gen++;
+	vm_ws_total = 0;
+	vm_ws_spaces = 0;
+	vm_ws_capacity = cm.num_free;
+	for(i = 0; i < cm.num_frames; i++) {
+		entry = cm.entries + i;
+		as = entry->as;
+		if(!entry->allocated || entry->kern || as == NULL) {
+			continue;
+		}
+		vm_ws_capacity++;
+		if(as->suspended) {
+			continue;
+		}
+		if(largest == NULL || as->rss > largest->rss) {
+			largest = as;
+		}
+		if(as->wsGen != vm_ws_gen) {
+			as->wsGen = vm_ws_gen;
+			as->wss = 0;
+			vm_ws_spaces++;
+		}
+		if(vmstats.vs_faults - entry->last_use <= CM_WSCLOCK_TAU) {
+			as->wss++;
+			vm_ws_total++;
+		}
+	}
+	vmstats.vs_ws_samples++;
+	return largest;
+}
+
+/*
+ * Load control. When the working sets no longer fit, every process
+ * faults the others' pages out and no one gets anything done; taking
+ * one away entirely lets the rest fit. A suspended process is swapped
+ * out and its TLB entries dropped, so its next fault from user mode
+ * waits in vm_fault until it is let back in. Faults inside copyin and
+ * copyout don't wait, since the kernel may hold locks others need.
+ *
+ * A thread looks at the system once a second. Many page-ins alone
+ * don't mean thrashing, so it also wants the cpus mostly idle: the
+ * processes are waiting on the disk rather than running. Only a
+ * process that shares the tick's faulting with another is swapped
+ * out, so the last one making progress never is. Processes are let
+ * back in oldest first, once their working set fits beside the
+ * others', or the others are gone. Since a running process may wait
+ * on a suspended one, the oldest is also let in regardless when no
+ * running process faulted in a tick, or after CM_LOAD_MAXWAIT ticks.
+ */
+
+/* True if the last sample's working sets leave room for frames more */
+static
+bool
+vm_load_fits(unsigned frames)
+{
+	return vm_ws_total + frames <
+		vm_ws_capacity - vm_ws_capacity / CM_THRASH_SLACK;
+}
+
+static
+void
+vm_load_suspend(struct addrspace *as)
+{
+	unsigned i;
+	struct coremap_entry *entry;
+
+	as->suspended = true;
+	as->suspendTick = vm_load_ticks;
+	vm_suspended[vm_num_suspended++] = as;
+	vmstats.vs_suspends++;
+
+	/* The paging lock is let go between pages, so faults aren't held
+	 * up for the whole swap-out; as may be let back in or destroyed
+	 * meanwhile, which clears vm_load_victim.
+	 */
+	vm_load_victim = as;
+	for(i = 0; i < cm.num_frames && vm_load_victim == as; i++) {
+		entry = cm.entries + i;
+		spinlock_acquire(&cm.chain_lock);
+		if(entry->as != as || !cm_evictable(entry)) {
+			spinlock_release(&cm.chain_lock);
+			continue;
+		}
+		cm_take_frame(i);
+		spinlock_release(&cm.chain_lock);
+
+		if(cm_evict(i)) {
+			/* Out of swap: keep the rest */
+			break;
+		}
+		lock_release(cm.paging_lock);
+		thread_yield();
+		lock_acquire(cm.paging_lock);
+	}
+	if(vm_load_victim != as) {
+		return;
+	}
+	vm_load_victim = NULL;
+
+	/* Shared frames stay, but it has to fault to use them */
+	vm_tlb_flush_as(as);
+}
+
+/* Lets suspended processes back in while they fit; with force, the
+ * oldest whether it fits or not
+ */
+static
+void
+vm_load_admit(bool force)
+{
+	struct addrspace *as;
+	unsigned i;
+
+	while(vm_num_suspended > 0) {
+		as = vm_suspended[0];
+		if(!force && vm_ws_total > 0 && !vm_load_fits(as->wss)) {
+			break;
+		}
+		force = false;
+		vm_ws_total += as->wss;
+		as->suspended = false;
+		if(as == vm_load_victim) {
+			vm_load_victim = NULL;
+		}
+		vm_num_suspended--;
+		for(i = 0; i < vm_num_suspended; i++) {
+			vm_suspended[i] = vm_suspended[i + 1];
+		}
+		vmstats.vs_resumes++;
+		cv_broadcast(vm_load_cv, cm.paging_lock);
+	}
+}
+
+/* Once a second: resample, then admit or suspend */
+static
+void
+vm_load_tick(void)
+{
+	struct addrspace *largest;
+	unsigned pageins, faulters, hardclocks, idleclocks, idle;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	largest = vm_ws_sample();
+	pageins = vmstats.vs_pageins - vm_ws_pageins;
+	vm_ws_pageins = vmstats.vs_pageins;
+	faulters = vm_load_faulters;
+	vm_load_faulters = 0;
+	vm_load_ticks++;
+
+	cpu_clocks(&hardclocks, &idleclocks);
+	idle = 0;
+	if(hardclocks != vm_load_hardclocks) {
+		idle = (idleclocks - vm_load_idleclocks) * 100 /
+			(hardclocks - vm_load_hardclocks);
+	}
+	vm_load_hardclocks = hardclocks;
+	vm_load_idleclocks = idleclocks;
+
+	if(vm_num_suspended > 0 && (faulters == 0 ||
+	   vm_load_ticks - vm_suspended[0]->suspendTick >= CM_LOAD_MAXWAIT)) {
+		vm_load_admit(true);
+		return;
+	}
+	if(pageins < CM_THRASH_PAGEINS || idle < CM_THRASH_IDLE ||
+	   vm_load_fits(0)) {
+		vm_load_admit(false);
+		return;
+	}
+	if(largest != NULL && faulters > 1 &&
+	   vm_num_suspended < CM_MAX_SUSPENDED) {
+		vm_load_suspend(largest);
+	}
+}
+
+static
+void
+vm_load_thread(void *data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+
+	while(1) {
+		clocksleep(1);
+		lock_acquire(cm.paging_lock);
+		vm_load_tick();
+		lock_release(cm.paging_lock);
+	}
+}
+
+void
+vm_load_forget(struct addrspace *as)
+{
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+
+	if(as->suspended) {
+		i = 0;
+		while(vm_suspended[i] != as) {
+			i++;
+		}
+		vm_num_suspended--;
+		for(; i < vm_num_suspended; i++) {
+			vm_suspended[i] = vm_suspended[i + 1];
+		}
+		as->suspended = false;
+		if(as == vm_load_victim) {
+			vm_load_victim = NULL;
+		}
+	}
+
+	/* Its frames are free now; see who fits */
+	if(vm_num_suspended > 0) {
+		vm_ws_sample();
+		vm_load_admit(false);
+	}
+}
+
+/*
+ * Page cleaner. When free frames run low, a daemon writes dirty frames
+ * just ahead of the clock hand to swap so that, when they are chosen,
+ * eviction can drop them without I/O. Frames are write-protected before
+ * they are copied; a write during the copy refaults and sets dirty
+ * again, so a stale copy is never taken for a clean one.
+ */
+static
+bool
+cm_needs_cleaning(void)
+{
+	return cm.num_free < CM_CLEAN_LOW;
+}
+
+/* Invalidates every entry in this cpu's TLB */
+static
+void
+vm_tlb_flush(void)
+{
+	int i, spl;
+
+	spl = splhigh();
+	for(i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i) | VM_TLBHI_ASID(curcpu->c_asid),
+			  TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * ASIDs. Each address space gets one of the NUM_TLBPID hardware ASIDs
+ * the first time it runs, and keeps it until every ASID has been
+ * handed out once; then the generation rolls over and every address
+ * space takes a new ASID on its next switch, each cpu flushing its TLB
+ * once before it loads an ASID from the new generation. ASID 0 is never
+ * handed out. An ASID also belongs to one cpu: an address space that
+ * moves to another cpu takes a new one, since entries left behind on
+ * the old cpu would miss the invalidations made elsewhere.
+ */
+void
+vm_asid_activate(struct addrspace *as)
+{
+	int spl;
+
+	spl = splhigh();
+	spinlock_acquire(&vm_asid_lock);
+	if(as->asidGen != vm_asid_gen || as->asidCpu != curcpu) {
+		if(vm_asid_next == NUM_TLBPID) {
+			vm_asid_gen++;
+			vm_asid_next = 1;
+			vmstats.vs_asidrollovers++;
+		}
+		as->asid = vm_asid_next++;
+		as->asidGen = vm_asid_gen;
+		as->asidCpu = curcpu;
+	}
+	spinlock_release(&vm_asid_lock);
+
+	curcpu->c_asid = as->asid;
+	if(curcpu->c_asidgen != as->asidGen) {
+		/* Entries from the last generation may reuse our ASIDs */
+		curcpu->c_asidgen = as->asidGen;
+		vm_tlb_flush();
+	} else {
+		/* Load the ASID into EntryHi; the probe matches nothing */
+		tlb_probe(TLBHI_INVALID(0) | VM_TLBHI_ASID(as->asid), 0);
+	}
+	splx(spl);
+}
+
+void
+vm_tlb_flush_as(struct addrspace *as)
+{
+	struct tlbshootdown ts;
+	struct cpu *target;
+
+	if(as == proc_getas()) {
+		/* Its entries under the old ASID are never matched again */
+		as->asidGen = 0;
+		vm_asid_activate(as);
+		return;
+	}
+
+	/* It may be running on its cpu right now, loading entries under
+	 * its ASID, so the ASID stays and later invalidations still reach
+	 * that cpu; only its entries there go.
+	 */
+	vm_tlbcache_flush();
+
+	spinlock_acquire(&vm_asid_lock);
+	target = as->asidCpu;
+	ts.ts_vaddr = TLBSHOOTDOWN_ASID;
+	ts.ts_asid = as->asid;
+	ts.ts_asidgen = as->asidGen;
+	if(target == curcpu) {
+		if(ts.ts_asidgen == curcpu->c_asidgen) {
+			vm_tlb_flush_asid(ts.ts_asid);
+		}
+		target = NULL;
+	}
+	spinlock_release(&vm_asid_lock);
+
+	if(target == NULL || ts.ts_asidgen == 0) {
+		return;
+	}
+
+	ipi_tlbshootdown(target, &ts);
+	vmstats.vs_shootdowns++;
+	ipi_tlbshootdown_wait(target);
+}
+
+/*
+ * Picks up to CM_CLEAN_BATCH dirty frames ahead of the clock hand,
+ * marks them clean and cleaning, and gives each a swap block (its old
+ * one if it has a stale copy). Returns how many were picked. Caller
+ * must hold the paging lock.
+ */
+static
+unsigned
+cm_cleaner_collect(unsigned *frames, unsigned *blocks)
+{
+	unsigned i, idx, n = 0, clean = cm.num_free;
+	struct coremap_entry *entry;
+	struct swap_hint hint;
+
+	spinlock_acquire(&cm.chain_lock);
+	idx = cm.clock_hand;
+	for(i = 0; i < cm.num_frames && n < CM_CLEAN_BATCH &&
+		    clean < CM_CLEAN_TARGET; i++) {
+		entry = cm.entries + idx;
+		idx = (idx + 1) % cm.num_frames;
+
+		if(!cm_evictable(entry)) {
+			continue;
+		}
+		if(cm_is_clean(entry)) {
+			clean++;
+			continue;
+		}
+		if(entry->has_swap) {
+			blocks[n] = entry->swap_idx;
+		} else {
+			vm_swap_hint(entry->as, entry->vaddr, &hint);
+			if(get_free_block(&hint, &blocks[n])) {
+				break;
+			}
+		}
+		entry->cleaning = 1;
+		entry->dirty = 0;
+		frames[n++] = entry - cm.entries;
+		clean++;
+	}
+	spinlock_release(&cm.chain_lock);
+
+	/* Their owners may still have writable TLB entries for them */
+	for(i = 0; i < n; i++) {
+		entry = cm.entries + frames[i];
+		vm_tlb_invalidate(entry->as, entry->vaddr, true);
+	}
+	vm_tlb_shootdown_wait();
+	return n;
+}
+
+static
+void
+vm_cleaner_thread(void *data1, unsigned long data2)
+{
+	unsigned frames[CM_CLEAN_BATCH], blocks[CM_CLEAN_BATCH];
+	int results[CM_CLEAN_BATCH];
+	unsigned i, n;
+	struct coremap_entry *entry;
+
+	(void)data1;
+	(void)data2;
+
+	lock_acquire(cm.paging_lock);
+	while(1) {
+		n = 0;
+		if(cm_needs_cleaning()) {
+			n = cm_cleaner_collect(frames, blocks);
+		}
+		if(n == 0) {
+			/* Idle: zero free frames (and freed swap blocks)
+			 * while nothing waits
+			 */
+			lock_release(cm.paging_lock);
+#if SWAP_SCRUB
+			swap_scrub(SWAP_SCRUB_BATCH);
+#endif
+			vm_zero_pool_fill();
+			lock_acquire(cm.paging_lock);
+			cv_wait(cleaner_cv, cm.paging_lock);
+			continue;
+		}
+
+		/* Faults and evictions go on while we write */
+		lock_release(cm.paging_lock);
+		for(i = 0; i < n; i++) {
+			results[i] = write_frame(cm.first_mapped_paddr +
+						 frames[i] * PAGE_SIZE,
+						 (off_t) blocks[i]);
+		}
+		lock_acquire(cm.paging_lock);
+
+		for(i = 0; i < n; i++) {
+			entry = cm.entries + frames[i];
+
+			spinlock_acquire(&cm.chain_lock);
+			if(!entry->cleaning) {
+				/* Freed while we were writing it */
+				spinlock_release(&cm.chain_lock);
+				clear_map_block(blocks[i]);
+				continue;
+			}
+			entry->cleaning = 0;
+			spinlock_release(&cm.chain_lock);
+
+			if(results[i]) {
+				entry->dirty = 1;
+				if(!entry->has_swap) {
+					clear_map_block(blocks[i]);
+				}
+				continue;
+			}
+			entry->swap_idx = blocks[i];
+			entry->has_swap = 1;
+			vmstats.vs_cleaned++;
+		}
+	}
 }
 
 /*
- * Check if we're in a context that can sleep. While most of the
- * operations in dumbvm don't in fact sleep, in a real VM system many
- * of them would. In those, assert that sleeping is ok. This helps
- * avoid the situation where syscall-layer code that works ok with
- * dumbvm starts blowing up during the VM assignment.
+ * Swap read-ahead. Pages evicted together sit in neighbouring blocks,
+ * so a fault on one reads in the swapped-out pages around it whose
+ * blocks continue the run, in the same request. Only done while free
+ * frames are plentiful; read-ahead never evicts anything.
  */
+
+/* The pte at va if it is swapped out to exactly block */
 static
-void
-vm_can_sleep(void)
+pageTableEntry_t *
+vm_cluster_in_candidate(struct addrspace *as, vaddr_t va, unsigned block)
 {
-	if (CURCPU_EXISTS()) {
-		/* must not hold spinlocks */
-		KASSERT(curcpu->c_spinlocks == 0);
+	pageTableEntry_t *pte;
 
-		/* must not be in an interrupt handler */
-		KASSERT(curthread->t_in_interrupt == 0);
+	if(va >= USERSPACETOP) {
+		return NULL;
 	}
+	pte = as_lookup_pte(as, va, false);
+	if(pte == NULL || IS_USED_PAGE(*pte) || !IS_ON_DISK(*pte) ||
+	   PTE_SWAP_BLOCK(*pte) != block || swap_shared(block)) {
+		return NULL;
+	}
+	return pte;
 }
 
-/* Used to get npages physical pages for kernel allocation,
- * or 1 page for non-kernel allocation. If kernel pages,
- * pte should be NULL.
+/*
+ * Reads the page at vaddr (pte on disk) into the frame at pa, together
+ * with whatever neighbours can be read ahead. Only the neighbours are
+ * mapped here; the caller finishes the faulting page.
  */
-paddr_t
-getppages(pageTableEntry_t *pte, unsigned long npages)
+static
+int
+vm_swap_in_cluster(struct addrspace *as, vaddr_t vaddr,
+		   pageTableEntry_t *pte, paddr_t pa)
 {
-	paddr_t addr;
-	/* Before vm_bootstrapped, we are stealing ram. After, coremap manages mem */
-	if(vm_bootstrapped) {
+	pageTableEntry_t *ptes[SWAP_CLUSTER];
+	paddr_t pas[SWAP_CLUSTER];
+	struct coremap_entry *entry;
+	unsigned i, b, f, n, block, first, room;
+	vaddr_t va;
+	int result;
+	bool ahead;
 
-		unsigned i, j;
-		int entry_found = 0;
-		int entry_idx;
+	block = PTE_SWAP_BLOCK(*pte);
+	room = cm.num_free > CM_CLEAN_LOW ? cm.num_free - CM_CLEAN_LOW : 0;
+	if(room > cm_rss_room(as)) {
+		room = cm_rss_room(as);
+	}
 
-		spinlock_acquire(&cm.cm_lock);
+	/* Neighbours must be in the faulting block's stripe */
+	for(b = 0; b + 1 < SWAP_CLUSTER && b < room; b++) {
+		if(block % SWAP_STRIPE < b + 1 || vaddr < (b + 1) * PAGE_SIZE ||
+		   vm_cluster_in_candidate(as, vaddr - (b + 1) * PAGE_SIZE,
+					   block - (b + 1)) == NULL) {
+			break;
+		}
+	}
+	for(f = 0; b + f + 1 < SWAP_CLUSTER && b + f < room; f++) {
+		if((block + f + 1) % SWAP_STRIPE == 0 ||
+		   vm_cluster_in_candidate(as, vaddr + (f + 1) * PAGE_SIZE,
+					   block + f + 1) == NULL) {
+			break;
+		}
+	}
+	n = b + f + 1;
+	first = block - b;
 
-		for(i = 0; i < cm.num_frames && !entry_found; i++) {
-			if((cm.entries + i)->allocated) {
-				continue;
-			}
+	if(n == 1) {
+		return swap_in(pa, block);
+	}
 
-			entry_found = 1;
-			entry_idx = i;
-			for(j = 0; j < npages; j++) {
-				if((cm.entries + i + j)->allocated) {
-					entry_found = 0;
-					break;
-				}
-			}
+	va = vaddr - b * PAGE_SIZE;
+	for(i = 0; i < n; i++, va += PAGE_SIZE) {
+		if(i == b) {
+			ptes[i] = pte;
+			pas[i] = pa;
+			continue;
 		}
-		/* No free frames found */
-		if(!entry_found) {
-			spinlock_release(&cm.cm_lock);
-			return 0;
+		ptes[i] = vm_cluster_in_candidate(as, va, first + i);
+		KASSERT(ptes[i] != NULL);
+		pas[i] = cm_alloc_frame(as, va, ptes[i]);
+		if(pas[i] == 0) {
+			break;
 		}
+	}
 
-		struct coremap_entry *return_entry;
-		return_entry = (cm.entries + entry_idx);
-
-		/* Only kernel pages have no pte */
-		if(!pte) {
-			for(j = 0; j < npages; j++) {
-				(return_entry + j)->allocated = 1;
-					(return_entry + j)->kern = 1;
-				if(j < npages - 1) {
-					(return_entry + j)->more_contig_frames = 1;
-				}
-			}
-		/* Non-kernel pages are allocated 1 at a time: no need to loop */
-		} else {
-			/* Set entry pte */
-			return_entry->pte = pte;
+	ahead = (i == n);
+	if(ahead) {
+		result = swap_read_cluster(pas, n, first);
+	} else {
+		/* Out of frames after all: just the faulting page */
+		result = swap_in(pa, block);
+	}
 
-			/* Update allocation order chain */
-			cm.entries[cm.last_allocated].next_allocated = entry_idx;
-			if(cm.oldest < 0) {
-				cm.oldest = entry_idx;
-			}
-			return_entry->prev_allocated = cm.last_allocated;
-			return_entry->next_allocated = -1;
-			cm.last_allocated = entry_idx;
+	while(i-- > 0) {
+		if(i == b) {
+			continue;
 		}
+		if(result || !ahead) {
+			cm_free_frames(pas[i]);
+			continue;
+		}
+		entry = cm.entries + CM_IDX(pas[i]);
+		entry->swap_idx = first + i;
+		entry->has_swap = 1;
+		entry->dirty = 0;
+		*ptes[i] = MAKE_PTE(pas[i], PTE_PERMS(*ptes[i]) + USED_BIT);
+		vmstats.vs_readahead++;
+	}
 
-		addr = cm.first_mapped_paddr + (entry_idx * PAGE_SIZE);
+	return result;
+}
 
-		spinlock_release(&cm.cm_lock);
+/*
+ * Page groups. The R3000 TLB maps one 4K page per entry, with no large
+ * or paired pages, so a big array can't be covered by fewer entries.
+ * What we can do is cut the faults it takes: the first touch of an
+ * untouched aligned group of anonymous pages zero-fills the whole group
+ * from one contiguous run and puts the neighbours in the software TLB,
+ * so touching them later is a refill without the paging lock rather
+ * than a fault each. Only done while memory is plentiful, since the
+ * neighbours may never be used; under pressure pages go one at a time.
+ */
+static
+bool
+vm_page_in_group(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *pte)
+{
+	vaddr_t base, va;
+	pageTableEntry_t perms[VM_PGROUP_PAGES], *first;
+	paddr_t pa;
+	uint32_t elo;
+	unsigned i;
+	int spl;
 
-	} else {
-		spinlock_acquire(&stealmem_lock);
+	if(cm_needs_cleaning() || cm_rss_room(as) < VM_PGROUP_PAGES) {
+		return false;
+	}
 
-		addr = ram_stealmem(npages);
+	/* A group lies in one page table, so its ptes are consecutive.
+	 * Each page gets the permissions a fault on it would: those of
+	 * its pte if defined, else of its region, else read/write.
+	 */
+	base = vaddr & ~(vaddr_t)(VM_PGROUP_SIZE - 1);
+	first = pte - (vaddr - base) / PAGE_SIZE;
+	for(i = 0, va = base; i < VM_PGROUP_PAGES; i++, va += PAGE_SIZE) {
+		if(!as_is_anonymous(as, va) || IS_USED_PAGE(first[i]) ||
+		   IS_ON_DISK(first[i])) {
+			return false;
+		}
+		if(!as_region_perms(as, va, &perms[i])) {
+			perms[i] = READ_BIT + WRITE_BIT;
+		}
+		if(perms[i] == 0) {
+			return false;
+		}
+		if(first[i] != 0) {
+			perms[i] = PTE_PERMS(first[i]);
+		}
+	}
 
-		spinlock_release(&stealmem_lock);
+	pa = cm_getppages(as, base, first, VM_PGROUP_PAGES);
+	if(pa == 0) {
+		return false;
 	}
-	return addr;
-}
+	bzero((void *)PADDR_TO_KVADDR(pa), VM_PGROUP_SIZE);
 
-/* wrapper to assume 1 page */
-paddr_t cm_alloc_frame(pageTableEntry_t *pte)
-{
-	return getppages(pte, 1);
+	/* Neighbours go in clean: the first write faults and checks its
+	 * own permissions, as for any page
+	 */
+	spl = splhigh();
+	for(i = 0, va = base; i < VM_PGROUP_PAGES; i++, va += PAGE_SIZE) {
+		as_define_pte(as, va, perms[i]);
+		first[i] = MAKE_PTE(pa + i * PAGE_SIZE, perms[i] + USED_BIT);
+		if(va != vaddr &&
+		   (IS_READ_PAGE(perms[i]) || IS_EXE_PAGE(perms[i]))) {
+			elo = PG_ADRS(first[i]) | TLBLO_VALID;
+			vm_tlbcache_insert(as, va, elo);
+		}
+	}
+	splx(spl);
+
+	vmstats.vs_zerofills += VM_PGROUP_PAGES;
+	vmstats.vs_pgroups++;
+	return true;
 }
 
-/* Allocate/free some kernel-space virtual pages */
-vaddr_t
-alloc_kpages(unsigned npages)
+/*
+ * Gives the page at vaddr a frame: read back from swap if it was
+ * evicted, read from the executable on first touch of a loaded
+ * segment (whole text pages via the shared text cache). An anonymous
+ * page read before it is written maps the shared zero frame
+ * copy-on-write; written, it gets a zero-filled frame, a page group
+ * at a time if it can. Evicts other pages if memory is full.
+ */
+static
+int
+vm_page_in(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *pte,
+	   bool write)
 {
+	int result;
 	paddr_t pa;
-	vm_can_sleep();
-	/* Get npages for kernel */
-	pa = getppages(NULL, npages);
-	if (pa==0) {
+	struct coremap_entry *entry;
+	struct vnode *v;
+	off_t offset;
+
+	if(!IS_ON_DISK(*pte) && as_text_page(as, vaddr, &v, &offset)) {
+		vmstats.vs_fileins++;
+		return textcache_map(as, vaddr, pte, v, offset);
+	}
+
+	if(!IS_ON_DISK(*pte) && !as_is_file_backed(as, vaddr)) {
+		if(!write) {
+			*pte = MAKE_PTE(vm_zero_frame,
+					PTE_PERMS(*pte) + COW_BIT + USED_BIT);
+			vmstats.vs_zeromaps++;
+			return 0;
+		}
+		if(vm_page_in_group(as, vaddr, pte)) {
+			return 0;
+		}
+		pa = vm_alloc_zeroed(as, vaddr, pte);
+		if(pa == 0) {
+			return ENOMEM;
+		}
+		*pte = MAKE_PTE(pa, PTE_PERMS(*pte) + USED_BIT);
 		return 0;
 	}
-	return PADDR_TO_KVADDR(pa);
+
+	pa = cm_alloc_frame_evict(as, vaddr, pte);
+	if(pa == 0) {
+		return ENOMEM;
+	}
+
+	if(IS_ON_DISK(*pte)) {
+		result = vm_swap_in_cluster(as, vaddr, pte, pa);
+		if(result) {
+			cm_free_frames(pa);
+			return result;
+		}
+		/* Keep the block: until written, the frame is clean. A block
+		 * other page tables still refer to since fork stays theirs.
+		 */
+		entry = cm.entries + CM_IDX(pa);
+		if(swap_shared(PTE_SWAP_BLOCK(*pte))) {
+			clear_map_block(PTE_SWAP_BLOCK(*pte));
+		} else {
+			entry->swap_idx = PTE_SWAP_BLOCK(*pte);
+			entry->has_swap = 1;
+			entry->dirty = 0;
+		}
+		vmstats.vs_pageins++;
+	} else if(as_is_file_backed(as, vaddr)) {
+		cm_io_begin(pa);
+		result = as_read_page(as, vaddr, (void *)PADDR_TO_KVADDR(pa));
+		cm_io_end(pa);
+		/* Only this process changes its page table */
+		KASSERT(!IS_USED_PAGE(*pte) && !IS_ON_DISK(*pte));
+		if(result) {
+			cm_free_frames(pa);
+			return result;
+		}
+		cm_mark_filebacked(pa);
+		vmstats.vs_fileins++;
+	}
+
+	*pte = MAKE_PTE(pa, PTE_PERMS(*pte) + USED_BIT);
+
+	return 0;
 }
 
+/*
+ * Software TLB. A refill that hits in this cpu's cache is loaded
+ * straight into the TLB without the paging lock. Entries are keyed by
+ * address space and page. A change to one page (eviction, cleaning,
+ * copy-on-write, a policy clearing a referenced bit) drops its slot on
+ * every cpu, with vm_tlb_invalidate; a change to a whole address space
+ * (fork, unmapping, protection, exit, suspension) bumps the generation
+ * under the paging lock and so drops them all. Context switches don't,
+ * which is where the cache pays off.
+ */
 void
-free_kpages(vaddr_t addr)
+vm_tlbcache_flush(void)
 {
-	if(vm_bootstrapped) {
-		cm_free_frames(KVADDR_TO_PADDR(addr));
-	}
+	KASSERT(lock_do_i_hold(cm.paging_lock));
+	vm_tlbcache_gen++;
 }
 
-int
-cm_free_frames(paddr_t pa)
+static
+unsigned
+vm_tlbcache_slot(struct addrspace *as, vaddr_t vaddr)
 {
-	unsigned cm_idx;
-	/* pa guaranteed to be page aligned, so truncation should not be
-	 * a concern here.
-	 */
-	KASSERT(pa >= cm.first_mapped_paddr);
-	KASSERT(pa % PAGE_SIZE == 0);
-	cm_idx = (pa - cm.first_mapped_paddr) / PAGE_SIZE;
+	return ((vaddr >> 12) ^ ((uintptr_t)as >> 4)) % VM_TLBCACHE_SIZE;
+}
 
-	/* verify within coremap bounds */
-	KASSERT(cm_idx < cm.num_frames);
+/*
+ * Drops the entry for vaddr in as from every cpu's cache. A cpu may be
+ * loading it into its TLB right now, but the TLB entry is then shot
+ * down after this; entries are only ever made under the paging lock.
+ */
+static
+void
+vm_tlbcache_drop(struct addrspace *as, vaddr_t vaddr)
+{
+	struct tlbcache_entry *tc;
+	struct cpu *c;
+	unsigned i, slot;
 
-	spinlock_acquire(&cm.cm_lock);
+	vaddr &= PAGE_FRAME;
+	slot = vm_tlbcache_slot(as, vaddr);
+	for(i = 0; (c = cpu_get(i)) != NULL; i++) {
+		tc = &c->c_tlbcache[slot];
+		if(tc->tc_as == as && tc->tc_ehi == vaddr) {
+			tc->tc_gen = 0;
+		}
+	}
+}
 
-	struct coremap_entry *to_free;
-	int more_to_free = 1;
+/* Loads the TLB from this cpu's cache; false on a miss */
+static
+bool
+vm_tlbcache_refill(struct addrspace *as, vaddr_t vaddr, int faulttype)
+{
+	struct tlbcache_entry *tc;
+	uint32_t ehi;
+	paddr_t pa;
+	int spl, idx;
+	bool hit;
 
-	while(more_to_free) {
-		to_free = (cm.entries + cm_idx);
+	spl = splhigh();
+	tc = &curcpu->c_tlbcache[vm_tlbcache_slot(as, vaddr)];
+	/* A write needs the entry to be writable already */
+	hit = tc->tc_gen == vm_tlbcache_gen && tc->tc_as == as &&
+		tc->tc_ehi == vaddr &&
+		(faulttype == VM_FAULT_READ || (tc->tc_elo & TLBLO_DIRTY));
+	if(hit) {
+		ehi = vaddr | VM_TLBHI_ASID(curcpu->c_asid);
+		idx = tlb_probe(ehi, 0);
+		if(idx >= 0) {
+			tlb_write(ehi, tc->tc_elo, idx);
+		} else {
+			tlb_random(ehi, tc->tc_elo);
+		}
 
-		to_free->pte = NULL;
-		to_free->tlb_idx = -1;
-		to_free->allocated = 0;
+		/* Refilling the TLB counts as a reference, as in vm_fault */
+		pa = tc->tc_elo & TLBLO_PPAGE;
+		if(pa != vm_zero_frame) {
+			spinlock_acquire(&cm.chain_lock);
+			cm.policy->rp_on_reference(CM_IDX(pa));
+			spinlock_release(&cm.chain_lock);
+		}
+		curcpu->c_tlbcache_hits++;
+	} else {
+		curcpu->c_tlbcache_misses++;
+	}
+	splx(spl);
 
-		/* Manage allocation chain (only applicable to non-kernel frames) */
-		if(!to_free->kern) {
-
-			/* If an entry was allocated before to_free, set its
-			 * next_allocated to be to_free's next_allocated
-		  	 */
-			if(to_free->prev_allocated >= 0) {
-				/* Shouldn't be oldest if has prev_allocated */
-				KASSERT(cm.oldest != (int) cm_idx);
-				(cm.entries + (to_free->prev_allocated))
-					->next_allocated
-					= to_free->next_allocated;
-			} else {
-				/* Should be oldest if no prev_allocated */
-				KASSERT(cm.oldest == (int) cm_idx);
-				cm.oldest = to_free->next_allocated;
-			}
-			/* If an entry was allocated after to_free, set its
-			 * prev_allocated to be to_free's prev_allocated
-			 */
-			if(to_free->next_allocated >= 0) {
-				/* Shouldn't be last_allocated if next allocated */
-				KASSERT(cm.last_allocated != (int) cm_idx);
-				(cm.entries + (to_free->next_allocated))
-					->prev_allocated
-					= to_free->prev_allocated;
-			} else {
-				/* Should be last_allocated if no next allocated */
-				KASSERT(cm.last_allocated == (int) cm_idx);
-				cm.last_allocated = to_free->prev_allocated;
-			}
+	return hit;
+}
+
+/* Remembers a TLB entry just loaded, less its ASID; call at splhigh */
+static
+void
+vm_tlbcache_insert(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+	struct tlbcache_entry *tc;
+
+	tc = &curcpu->c_tlbcache[vm_tlbcache_slot(as, vaddr)];
+	tc->tc_as = as;
+	tc->tc_ehi = vaddr;
+	tc->tc_elo = elo;
+	tc->tc_gen = vm_tlbcache_gen;
+}
 
-			/* Remove to_free from allocation chain */
-			to_free->prev_allocated = -1;
-			to_free->next_allocated = -1;
+/*
+ * Resolves a fault on a COW page. The last mapping of a frame takes it
+ * back as a private page; a write to a still shared one gets its own
+ * copy.
+ */
+static
+int
+vm_cow_fault(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *pte,
+	     bool write)
+{
+	unsigned idx = CM_IDX(PG_ADRS(*pte));
+	struct coremap_entry *entry = cm.entries + idx;
+	struct coremap_entry *copy;
+	paddr_t pa;
+	bool pinned;
 
+	/* The zero frame is never owned; writing gets a fresh frame */
+	if(PG_ADRS(*pte) == vm_zero_frame) {
+		if(!write) {
+			return 0;
 		}
+		pa = vm_alloc_zeroed(as, vaddr, pte);
+		if(pa == 0) {
+			return ENOMEM;
+		}
+		*pte = MAKE_PTE(pa, PTE_PERMS(*pte) + USED_BIT);
+		vm_tlbcache_drop(as, vaddr);
+		return 0;
+	}
 
-		to_free->kern = 0;
+	/* The last mapping claims an orphaned frame, the text cache's
+	 * reference aside; a cached page stays copy-on-write
+	 */
+	if(entry->refcount <= (entry->cached ? 2u : 1u)) {
+		if(entry->pte != pte) {
+			KASSERT(entry->pte == NULL);
+			spinlock_acquire(&cm.chain_lock);
+			entry->pte = pte;
+			entry->as = as;
+			entry->vaddr = vaddr;
+			as->rss++;
+			cm_rs_insert(idx);
+			cm.policy->rp_on_alloc(idx);
+			spinlock_release(&cm.chain_lock);
+		}
+		if(!entry->cached) {
+			*pte &= ~COW_BIT;
+			return 0;
+		}
+	}
+	if(!write) {
+		return 0;
+	}
 
-		more_to_free = to_free->more_contig_frames;
-		to_free->more_contig_frames = 0;
+	/* A cached frame this pte owns is evictable: keep it put while
+	 * the copy gets a frame
+	 */
+	pinned = cm_in_policy(entry);
+	if(pinned) {
+		spinlock_acquire(&cm.chain_lock);
+		cm_take_frame(idx);
+		spinlock_release(&cm.chain_lock);
+	}
+	pa = cm_alloc_frame_evict(as, vaddr, pte);
+	if(pinned) {
+		cm_requeue_frame(idx);
+	}
+	if(pa == 0) {
+		return ENOMEM;
+	}
+	memcpy((void *)PADDR_TO_KVADDR(pa),
+	       (void *)PADDR_TO_KVADDR(PG_ADRS(*pte)), PAGE_SIZE);
 
-		cm_idx++;
+	entry->refcount--;
+	if(entry->pte == pte) {
+		cm_orphan_frame(idx);
 	}
 
-	spinlock_release(&cm.cm_lock);
+	copy = cm.entries + CM_IDX(pa);
+	copy->dirty = 1;
+	*pte = MAKE_PTE(pa, PTE_PERMS(*pte) + USED_BIT);
+	vm_tlbcache_drop(as, vaddr);
+	vmstats.vs_cowcopies++;
 
 	return 0;
 }
 
-int select_victim(unsigned *idxptr) {
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	int result, spl, idx;
+	struct addrspace *as;
+	pageTableEntry_t *pte;
+	struct coremap_entry *entry;
+	uint32_t ehi, elo;
+	pageTableEntry_t perms;
+	bool writable;
 
-	spinlock_acquire(&cm.cm_lock);
+	faultaddress &= PAGE_FRAME;
 
-	if(cm.oldest < 0) {
-		spinlock_release(&cm.cm_lock);
-		kprintf("No suitable eviction victim: either get_victim called when free frames existed or memory is full of kernel pages.\n");
-		return -1;
+	if(curproc == NULL) {
+		/* Kernel fault early in boot: nothing to map */
+		return EFAULT;
 	}
 
-	*idxptr = cm.oldest;
-	/* Case when only one is allocated (the rest could be kernel allocs) */
-	if(cm.oldest == cm.last_allocated) {
-		cm.last_allocated = -1;
+	as = proc_getas();
+	if(as == NULL || faultaddress >= USERSPACETOP) {
+		return EFAULT;
 	}
-	/* Update the the oldest allocated tracker */
-	cm.oldest = (cm.entries + cm.oldest)->next_allocated;
-	/* If there is a new oldest, make sure none are shown prev_allocated */
-	if(cm.oldest >= 0) {
-		(cm.entries + cm.oldest)->prev_allocated = -1;
+
+	if(faulttype != VM_FAULT_READONLY &&
+	   vm_tlbcache_refill(as, faultaddress, faulttype)) {
+		return 0;
 	}
 
-	spinlock_release(&cm.cm_lock);
-	return 0;
-}
+	lock_acquire(cm.paging_lock);
+	vmstats.vs_faults++;
 
-int evict_frame(pageTableEntry_t **pte, unsigned *swap_idx) {
-	int result;
-	unsigned frame_idx;
+	/* Swapped out by load control: wait to be let back in */
+	while(as->suspended && curthread->t_machdep.tm_badfaultfunc == NULL) {
+		cv_wait(vm_load_cv, cm.paging_lock);
+	}
+	if(!as->suspended && as->faultTick != vm_load_ticks) {
+		as->faultTick = vm_load_ticks;
+		vm_load_faulters++;
+	}
 
-	result = select_victim(&frame_idx);
-	if(result) {
-		return result;
+	/* Defined regions give a page its permissions; heap and stack
+	 * pages may be touched without being defined.
+	 */
+	if(!as_region_perms(as, faultaddress, &perms)) {
+		if(!as_is_anonymous(as, faultaddress)) {
+			lock_release(cm.paging_lock);
+			return EFAULT;
+		}
+		perms = READ_BIT + WRITE_BIT;
+	}
+	if(perms == 0) {
+		lock_release(cm.paging_lock);
+		return EFAULT;
+	}
+	pte = as_define_pte(as, faultaddress, perms);
+	if(pte == NULL) {
+		lock_release(cm.paging_lock);
+		return ENOMEM;
 	}
 
-	*pte = (cm.entries + frame_idx)->pte;
+	/* Honor the permissions from as_define_region */
+	writable = IS_WRITE_PAGE(*pte);
+	switch(faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_WRITE:
+		if(!writable) {
+			lock_release(cm.paging_lock);
+			return EFAULT;
+		}
+		break;
+	    case VM_FAULT_READ:
+		if(!IS_READ_PAGE(*pte) && !IS_EXE_PAGE(*pte)) {
+			lock_release(cm.paging_lock);
+			return EFAULT;
+		}
+		break;
+	    default:
+		lock_release(cm.paging_lock);
+		return EINVAL;
+	}
 
-	/* first_mapped_paddr won't be changing at this point: lock unnecessary */
-	paddr_t pa;
-	pa = frame_idx * PAGE_SIZE + cm.first_mapped_paddr;
+	if(!IS_USED_PAGE(*pte)) {
+		result = vm_page_in(as, faultaddress, pte,
+				    faulttype != VM_FAULT_READ);
+		if(result) {
+			lock_release(cm.paging_lock);
+			return result;
+		}
+		if(cm_needs_cleaning()) {
+			cv_signal(cleaner_cv, cm.paging_lock);
+		}
+	}
+	if(IS_COW_PAGE(*pte)) {
+		result = vm_cow_fault(as, faultaddress, pte,
+				      faulttype != VM_FAULT_READ);
+		if(result) {
+			lock_release(cm.paging_lock);
+			return result;
+		}
+	}
+	ehi = faultaddress;
+	elo = PG_ADRS(*pte) | TLBLO_VALID;
 
-	result = swap_out(pa, swap_idx);
+	/* The zero frame belongs to no one and is never written */
+	if(PG_ADRS(*pte) != vm_zero_frame) {
+		entry = cm.entries + CM_IDX(PG_ADRS(*pte));
 
-	if(result) {
-		/* Because failure, NULL out *pte */
-		*pte = 0;
-		return result;
+		/* Refilling the TLB counts as a reference */
+		cm.policy->rp_on_reference(CM_IDX(PG_ADRS(*pte)));
+
+		/* Pages are mapped read-only until written, so a write
+		 * fault is how we learn the frame no longer matches its
+		 * swap copy.
+		 */
+		if(faulttype != VM_FAULT_READ) {
+			entry->dirty = 1;
+			entry->filebacked = 0;
+		}
+		if(writable && entry->dirty && !IS_COW_PAGE(*pte)) {
+			elo |= TLBLO_DIRTY;
+		}
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	ehi |= VM_TLBHI_ASID(curcpu->c_asid);
+	idx = tlb_probe(ehi, 0);
+	if(idx >= 0) {
+		tlb_write(ehi, elo, idx);
+	} else {
+		tlb_random(ehi, elo);
 	}
+	vm_tlbcache_insert(as, faultaddress, elo);
+	splx(spl);
 
+	lock_release(cm.paging_lock);
 	return 0;
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
+void
+vm_printstats(bool reset)
 {
-	kprintf("So we are here somehow");
-	return 0;
+	kprintf("vm: %s replacement, %u/%u frames free\n",
+		cm.policy->rp_name, cm.num_free, cm.num_frames);
+	kprintf("vm: %u faults, %u zero-fills, %u page-ins, %u evictions\n",
+		vmstats.vs_faults, vmstats.vs_zerofills,
+		vmstats.vs_pageins, vmstats.vs_evictions);
+	kprintf("vm: %u clean evictions, %u pages cleaned in background\n",
+		vmstats.vs_clean_evictions, vmstats.vs_cleaned);
+	kprintf("vm: %u pages clustered on swap-out, %u read ahead\n",
+		vmstats.vs_clustered, vmstats.vs_readahead);
+	kprintf("vm: %u copy-on-write copies, %u pages read from executables\n",
+		vmstats.vs_cowcopies, vmstats.vs_fileins);
+	kprintf("vm: %u ASID rollovers, %u TLB shootdowns\n",
+		vmstats.vs_asidrollovers, vmstats.vs_shootdowns);
+	kprintf("vm: %u page groups zero-filled at once\n",
+		vmstats.vs_pgroups);
+	kprintf("vm: %u zero frame mappings, %u pre-zeroed frames used\n",
+		vmstats.vs_zeromaps, vmstats.vs_prezeroed);
+	kprintf("vm: %u local evictions, resident set limit %u frames\n",
+		vmstats.vs_local_evictions, vm_rss_limit);
+	kprintf("vm: working sets total %u frames in %u address spaces "
+		"(%u samples)\n", vm_ws_total, vm_ws_spaces,
+		vmstats.vs_ws_samples);
+	kprintf("vm: %u processes suspended by load control, %u resumed, "
+		"%u waiting\n", vmstats.vs_suspends, vmstats.vs_resumes,
+		vm_num_suspended);
+	swap_printstats(reset);
+	kprintf("vm: cpu%u software TLB %u hits, %u misses\n",
+		curcpu->c_number, curcpu->c_tlbcache_hits,
+		curcpu->c_tlbcache_misses);
+	if(reset) {
+		bzero(&vmstats, sizeof(vmstats));
+		curcpu->c_tlbcache_hits = 0;
+		curcpu->c_tlbcache_misses = 0;
+	}
+}
+
+void
+vm_tlbshootdown_all(void)
+{
+	vm_tlb_flush();
 }
 
+/* Called at splhigh from interprocessor_interrupt */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	/* A flush for a new generation already took the entry */
+	if(ts->ts_asidgen != curcpu->c_asidgen) {
+		return;
+	}
+	if(ts->ts_vaddr == TLBSHOOTDOWN_ASID) {
+		vm_tlb_flush_asid(ts->ts_asid);
+	} else {
+		vm_tlb_invalidate_local(ts->ts_asid, ts->ts_vaddr);
+	}
 }
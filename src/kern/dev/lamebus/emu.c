@@ -845,13 +845,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Mapped pages are read with emufs_read as they are touched.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
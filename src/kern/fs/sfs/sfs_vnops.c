@@ -232,14 +232,15 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Mapped pages are read with sfs_read as they are
+ * touched, so any regular file can be mapped.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -39,6 +39,7 @@
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct cpu;
 
 
 /*
@@ -66,6 +67,7 @@ struct pageTableEntryMap_t {
  #define IS_EXE_PAGE(pageTableEntry) ((pageTableEntry_t)pageTableEntry & EXECUTE_BIT)
  #define IS_ON_DISK(pageTableEntry) ((pageTableEntry_t)pageTableEntry & DISK_BIT)
  #define IS_USED_PAGE(pageTableEntry) ((pageTableEntry_t)pageTableEntry & USED_BIT)
+ #define IS_COW_PAGE(pageTableEntry) ((pageTableEntry_t)pageTableEntry & COW_BIT)
 
 // get pieces from vaddr_t or pageTableEntry_t
 #define DIR_TBL_OFFSET(pageTableEntry) ((pageTableEntry_t)pageTableEntry & DIRECTORY_OFFSET)>>22 // first 10 - throw away the last 22
@@ -76,12 +78,36 @@ struct pageTableEntryMap_t {
  #define MAKE_PTE_ADDR(dirIdx,pgTblIdx,psyOffset) (pageTableEntry_t *)(((dirIdx)<<22) + ((pgTblIdx)<<12) + psyOffset) // 10 from dirIdx; 10 from pgTblIdx; 12 phsy ofset
  #define MAKE_VADDR(dirIdx,pgTblIdx,psyOffset)               (vaddr_t)(((dirIdx)<<22) + ((pgTblIdx)<<12) + psyOffset) // 10 from dirIdx; 10 from pgTblIdx; 12 phsy ofset
 
- // Make a PTE or PG_TBL_ADDR
- #define MAKE_PG_TBL_ADDR(dirIdx) (pageTableEntry_t *)((dirIdx)<<12) // dirIdx == 0 is unused by load_elf -- use these addresses for the page tables
+ // Make a PTE
  #define MAKE_PTE(paddr, otherBits) (pageTableEntry_t)(paddr + otherBits)
  #define PTE_TO_KVADDR(pte) PADDR_TO_KVADDR(PG_ADRS(pte))
  #define PTE_TO_KPG_TBL(pte) (pageTableEntry_t*)(PTE_TO_KVADDR(pte))
 
+ // permission bits set by as_define_region
+ #define PTE_PERMS(pte) ((pageTableEntry_t)(pte) & (READ_BIT | WRITE_BIT | EXECUTE_BIT))
+ // swapped out pages keep their swap block index where the paddr_t was
+ #define PTE_SWAP_BLOCK(pte) (unsigned)(PG_ADRS(pte) >> 12)
+ #define MAKE_SWAP_PTE(block, perms) (pageTableEntry_t)(((block) << 12) + (perms) + DISK_BIT)
+
+// user stack is VM_STACKPAGES below USERSTACK, allocated as it is touched
+#define VM_STACKPAGES 256
+
+// a region defined by as_define_region: permissions for its pages and,
+// for an executable's segments, where their contents come from. Pages
+// are read from the file the first time they are touched, past
+// rgnFileSize they are zero. Regions are kept sorted and don't overlap.
+struct as_region {
+  vaddr_t rgnBase;
+  size_t rgnSize;
+  pageTableEntry_t rgnPerms;	// READ_BIT/WRITE_BIT/EXECUTE_BIT
+  struct vnode *rgnVnode;	// NULL if not file backed, else referenced
+  off_t rgnOffset;		// file offset of rgnBase
+  size_t rgnFileSize;
+  bool rgnText;			// clean pages shared via the text cache
+  bool rgnShared;		// MAP_SHARED: may not be made writable
+};
+#define AS_MAXREGIONS 16
+
 
 struct addrspace {
 #if OPT_DUMBVM
@@ -95,9 +121,36 @@ struct addrspace {
 #else
   // a directory table entry with entries for the pageTables
   pageTableEntry_t *pgDirectoryPtr;//[PAGE_TABLE_ENTRIES];
+  // nonzero PTEs in each pageTable; it is freed when this drops to 0
+  uint16_t *pgTblLive;//[PAGE_TABLE_ENTRIES];
   vaddr_t stackPtr;
   vaddr_t textTopPtr;
   vaddr_t heapPtr;
+  struct as_region regions[AS_MAXREGIONS];
+  unsigned numRegions;
+  // hardware ASID, valid while asidGen is the current ASID generation
+  // and the address space stays on cpu asidCpu, the only cpu that can
+  // have TLB entries for it
+  unsigned asid;
+  unsigned asidGen;
+  struct cpu *asidCpu;
+  // frames this address space owns in the coremap, updated under the
+  // paging lock, and the most it may own before it replaces its own
+  // pages (0 for no limit); the frames are listed from rsFirst (-1 for
+  // none) through the coremap
+  unsigned rss;
+  unsigned rssLimit;
+  int rsFirst;
+  // working set estimate: frames used in the last CM_WSCLOCK_TAU
+  // faults, valid while wsGen is the vm's current sample
+  unsigned wss;
+  unsigned wsGen;
+  // swapped out by load control: faults from user mode wait until
+  // there is room for its working set again; the load control tick
+  // it was suspended in, and the last tick it faulted in
+  bool suspended;
+  unsigned suspendTick;
+  unsigned faultTick;
 #endif
 };
 
@@ -138,6 +191,52 @@ struct addrspace {
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_lookup_pte - find the page table entry for a user address,
+ *                optionally allocating its second level page table.
+ *                Returns NULL if there is none (or none could be made).
+ *
+ *    as_define_pte - find the page table entry for a user address,
+ *                allocating its page table if needed, and give it PERMS
+ *                if it is still undefined. NULL if out of memory.
+ *
+ *    as_unmap_range - release every page in [START, END), freeing page
+ *                tables left empty.
+ *
+ *    as_pt_reclaim - give one cached free page table back to the
+ *                coremap. False if there were none.
+ *
+ *    as_is_anonymous - true if the address is in the heap or stack,
+ *                which are zero-filled on demand without being defined
+ *                through as_define_region.
+ *
+ *    as_define_segment - record the file contents of a region, to be
+ *                read in page by page as it is touched.
+ *
+ *    as_region_perms - find the permissions of the page at the address
+ *                from the regions overlapping it. False if there are
+ *                none.
+ *
+ *    as_is_file_backed - true if some of the page at the address comes
+ *                from a segment's file contents.
+ *
+ *    as_read_page - fill a kernel buffer with the page at the address:
+ *                file contents of every segment overlapping it, zeroes
+ *                elsewhere.
+ *
+ *    as_text_page - true if the page at the address is a whole page of
+ *                one text segment's file contents, which can be shared;
+ *                hands back the vnode and file offset.
+ *
+ *    as_range_mapped - true if any region overlaps [START, END).
+ *
+ *    as_mmap   - map LEN bytes of anonymous memory, with PROT_ and
+ *                MAP_ values as for mmap(). Hands back the address
+ *                chosen.
+ *
+ *    as_munmap - remove the mappings and release the pages in a range.
+ *
+ *    as_mprotect - change the permissions of a mapped range.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -156,6 +255,32 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+pageTableEntry_t *as_lookup_pte(struct addrspace *as, vaddr_t vaddr,
+                                bool create);
+pageTableEntry_t *as_define_pte(struct addrspace *as, vaddr_t vaddr,
+                                pageTableEntry_t perms);
+void              as_unmap_range(struct addrspace *as, vaddr_t start,
+                                 vaddr_t end);
+bool              as_pt_reclaim(void);
+bool              as_is_anonymous(struct addrspace *as, vaddr_t vaddr);
+int               as_define_segment(struct addrspace *as, struct vnode *v,
+                                    off_t offset, vaddr_t vaddr,
+                                    size_t memsize, size_t filesize,
+                                    bool text);
+bool              as_region_perms(struct addrspace *as, vaddr_t vaddr,
+                                  pageTableEntry_t *permsp);
+bool              as_is_file_backed(struct addrspace *as, vaddr_t vaddr);
+int               as_read_page(struct addrspace *as, vaddr_t vaddr,
+                               void *kbuf);
+bool              as_text_page(struct addrspace *as, vaddr_t vaddr,
+                               struct vnode **vp, off_t *offsetp);
+bool              as_range_mapped(struct addrspace *as, vaddr_t start,
+                                  vaddr_t end);
+int               as_mmap(struct addrspace *as, vaddr_t addr, size_t len,
+                          int prot, int flags, vaddr_t *retp);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
+int               as_mprotect(struct addrspace *as, vaddr_t addr, size_t len,
+                              int prot);
 
 
 /*
@@ -33,7 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
-#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX, CM_MAGAZINE_SIZE */
 
 
 /*
@@ -60,8 +60,33 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_idleclocks;		/* ...of which found the cpu idle */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 *
+	 * Free frames reserved from the coremap (which still shows
+	 * them as allocated), so most single frame allocations and
+	 * frees don't need the coremap lock.
+	 */
+	unsigned c_frames[CM_MAGAZINE_SIZE];
+	unsigned c_numframes;
+
+	/*
+	 * Software TLB, and how often it saved a page table walk.
+	 */
+	struct tlbcache_entry c_tlbcache[VM_TLBCACHE_SIZE];
+	unsigned c_tlbcache_hits;
+	unsigned c_tlbcache_misses;
+
+	/*
+	 * ASID in EntryHi, and the ASID generation this cpu's TLB was
+	 * last flushed for.
+	 */
+	unsigned c_asid;
+	unsigned c_asidgen;
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -82,10 +107,14 @@ struct cpu {
 	 * The contents of struct tlbshootdown are also machine-
 	 * dependent and might reasonably be either an address space
 	 * and vaddr pair, or a paddr, or something else.
+	 *
+	 * Requests beyond TLBSHOOTDOWN_MAX set c_shootdown_all instead,
+	 * and the whole TLB is flushed.
 	 */
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	unsigned c_numshootdown;
+	bool c_shootdown_all;
 	struct spinlock c_ipi_lock;
 };
 
@@ -137,6 +166,17 @@ void cpu_irqon(void);
 void cpu_idle(void);
 void cpu_halt(void);
 
+/*
+ * Adds up, over all cpus, the hardclock ticks so far and how many of
+ * them found the cpu idle: a measure of how much work gets done. The
+ * per-cpu counters are read without locking, so the sums are only
+ * approximate.
+ */
+void cpu_clocks(unsigned *hardclocks, unsigned *idleclocks);
+
+/* The cpu numbered num, or NULL past the last one */
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Interprocessor interrupts.
  *
@@ -150,6 +190,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_wait waits until the target has handled every
+ * shootdown queued for it so far. Call it without spinlocks held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -164,6 +206,7 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target);
 
 void interprocessor_interrupt(void);
 
@@ -0,0 +1,26 @@
+/*
+ * Constants for libc's <sys/mman.h> and the mmap(), munmap() and
+ * mprotect() system calls.
+ */
+
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/* Protection for mmap and mprotect: PROT_NONE or any of the others */
+#define PROT_NONE     0      /* Pages can't be accessed */
+#define PROT_READ     1      /* Pages can be read */
+#define PROT_WRITE    2      /* Pages can be written */
+#define PROT_EXEC     4      /* Pages can be executed */
+
+/* Flags for mmap: choose one of these: */
+#define MAP_SHARED    1      /* Changes are shared */
+#define MAP_PRIVATE   2      /* Changes are private */
+/* then or in any of these: */
+#define MAP_FIXED     4      /* Map at exactly the address given */
+#define MAP_ANON      8      /* Zero-filled memory, not a file */
+#define MAP_ANONYMOUS MAP_ANON
+
+/* What mmap returns on failure */
+#define MAP_FAILED    ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -10,23 +10,87 @@
 #include <addrspace.h>
 #include <bitmap.h>
 
-/* TODO: design a more refined size system here */
-#define SWAPDISK_SIZE 	1048576
-#define NUM_BLOCKS	SWAPDISK_SIZE / PAGE_SIZE
+/*
+ * Swap devices. lhd0: is the swap disk. Raising SWAP_NDISKS attaches
+ * lhd1: and on as well, as many of them as exist up to that number;
+ * vfs_swapon claims them, so they can no longer be mounted (the test
+ * scripts mount lhd1:). Swap blocks are striped across the disks
+ * SWAP_STRIPE blocks at a time, so neighbouring blocks stay on one disk
+ * while the load spreads over all of them. Each disk contributes as
+ * many stripes as the smallest one holds.
+ */
+#define SWAP_NDISKS	1
+#define SWAP_STRIPE	8
+
+/* Most pages moved in one clustered request: at most one stripe */
+#define SWAP_CLUSTER	SWAP_STRIPE
+
+/*
+ * Block placement. A page's slot is its virtual page number modulo
+ * SWAP_STRIPE, and a stripe holds each slot once, so pages that
+ * neighbour in memory land in neighbouring blocks and can be read back
+ * in one request. A page asks for the block at its slot in the stripe
+ * its neighbours already use (sh_block), or else starts an empty
+ * stripe at its slot. When neither is free it takes a block from the
+ * fullest stripe that has one, keeping empty stripes for new runs.
+ */
+#define SWAP_NOBLOCK	((unsigned)-1)
+
+struct swap_hint {
+	unsigned sh_block;	/* wanted block, or SWAP_NOBLOCK */
+	unsigned sh_slot;	/* slot in a stripe, if sh_block is taken */
+};
+
+/*
+ * Scrubbing. Freeing a swap block is normally just a bitmap update, so
+ * old page contents linger on the swap disk. With SWAP_SCRUB set, freed
+ * blocks are queued instead and zeroed by the page cleaner in batches
+ * of SWAP_SCRUB_BATCH before they can be reused.
+ */
+#define SWAP_SCRUB	0
+#define SWAP_SCRUB_BATCH 8
 
-/* Structures for organizing backing store */
-static struct vnode *swapdisk; 
-static struct spinlock swaplock; // needed?
-static struct bitmap *swapmap;
+/*
+ * Compressed swap cache. Pages written to swap are first compressed
+ * into a ring of SWAP_ZPAGES kernel pages kept in front of the disks
+ * (0 turns it off), and only the oldest are written out when the ring
+ * fills. A page is stored as 2-bit tags, one per word (zero, same as
+ * the word before, or literal), followed by its literal words; a page
+ * of one repeated word takes no room at all. Pages that don't shrink
+ * below SWAP_ZMAXSIZE bytes go straight to disk. Each cached page
+ * still has its swap block, which is what the cache is keyed by.
+ *
+ * Once the disks are full, pages go to SWAP_ZSPARE blocks past their
+ * end that only the cache holds. Those are never written back, so they
+ * stay in the ring until freed, and swapping to one fails if the page
+ * doesn't compress or the ring has no room left.
+ *
+ * The ring and its index are pinned kernel memory, and on the 1 MiB
+ * configuration they cost more frames than they spare the disk, so the
+ * cache is off by default.
+ */
+#define SWAP_ZPAGES	0
+#define SWAP_ZMAXSIZE	(PAGE_SIZE * 3 / 4)
+#define SWAP_ZSPARE	(SWAP_ZPAGES * 8)
 
-/* initializes swap disk for memory swapping */
+/* Attaches the swap disks and sizes the swap map from them. Fails with
+ * ENODEV if there is no swap disk and ENOSPC if it holds no stripe;
+ * the system then runs without paging.
+ */
 int init_swapdisk(void);
 
-/* Swaps data in swap block blocknum into memory at pa */
+/* Total number of swap blocks across all swap disks, and spare ones */
+unsigned swap_nblocks(void);
+
+/* Swaps data in swap block blocknum into memory at pa. The block is
+ * left allocated; release it with clear_map_block once unneeded.
+ */
 int swap_in(paddr_t pa, unsigned blocknum);
 
-/* Swaps data at pa onto disk, storing block index in blocknum. */ 
-int swap_out(paddr_t pa, unsigned *blocknum);
+/* Swaps data at pa onto disk, placed by hint (may be NULL), storing
+ * block index in blocknum.
+ */
+int swap_out(paddr_t pa, const struct swap_hint *hint, unsigned *blocknum);
 
 /* Reads page from swap disk into physical memory if page on swap disk */
 int read_block(paddr_t pa, off_t blocknum);
@@ -34,14 +98,42 @@ int read_block(paddr_t pa, off_t blocknum);
 /* Writes page from physical memory into swap disk */
 int write_frame(paddr_t pa, off_t blocknum);
 
-/* Finds a free block on swap disk and sets it as allocated */
-int get_free_block(unsigned *idxptr);
+/* Reads/writes the n pages at pas from/to the n blocks starting at
+ * first, in one request. The blocks must not cross a stripe.
+ */
+int swap_read_cluster(const paddr_t *pas, unsigned n, unsigned first);
+int swap_write_cluster(const paddr_t *pas, unsigned n, unsigned first);
+
+/* Finds a free block on swap disk, placed by hint (may be NULL), and
+ * sets it as allocated
+ */
+int get_free_block(const struct swap_hint *hint, unsigned *idxptr);
+
+/* Allocates n (<= SWAP_CLUSTER) contiguous blocks within one stripe,
+ * the first placed by hint (may be NULL)
+ */
+int get_free_cluster(unsigned n, const struct swap_hint *hint,
+		     unsigned *firstptr);
+
+/* Adds a reference to block idx, for a page table sharing it after fork */
+void swap_share(unsigned idx);
 
-/* Sets block at idx as unallocated */
+/* True if more than one page table refers to block idx */
+bool swap_shared(unsigned idx);
+
+/* Drops a reference to block idx; the last one sets it unallocated
+ * (queued for scrubbing if SWAP_SCRUB).
+ */
 void clear_map_block(unsigned idx);
 
-/* To me, the logic of the following functions should be in the coremap/clean sweeper */
-/* Writes page in memory to swap disk to make clean */
-/*int clean_page(???)*/ 
+/* Zeroes and releases up to max queued blocks. Returns how many. */
+unsigned swap_scrub(unsigned max);
+
+/* Prints (and with reset, clears) the compressed swap cache counters */
+void swap_printstats(bool reset);
+
+/* Cleaning dirty pages ahead of eviction is done by the page cleaner
+ * thread in vm.c, using get_free_block and write_frame.
+ */
 
 #endif /* _SWAP_H_ */
@@ -59,6 +59,10 @@ __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
 int sys_sbrk(vaddr_t *resultPtr, __intptr_t change);
+int sys_mmap(vaddr_t *resultPtr, vaddr_t addr, size_t len, int prot,
+	     int flags);
+int sys_munmap(vaddr_t addr, size_t len);
+int sys_mprotect(vaddr_t addr, size_t len, int prot);
 void sys__exit(int status);
 
 #endif /* _SYSCALL_H_ */
@@ -0,0 +1,41 @@
+/*
+ * Declarations for the shared text page cache
+ */
+
+#ifndef _TEXTCACHE_H_
+#define _TEXTCACHE_H_
+
+#include <types.h>
+#include <vnode.h>
+#include <addrspace.h>
+
+/*
+ * Whole pages of read-only executable segments are cached by (vnode,
+ * file offset), so every process running the same program maps the
+ * same frames copy-on-write instead of reading its own copy. The cache
+ * holds a frame reference and a vnode reference per page. Executables
+ * are assumed not to change while cached.
+ */
+#define TEXTCACHE_PAGES	64
+
+/* Maps the text page at vaddr, file offset offset of v, into *pte from
+ * the cache, reading it in on a miss. Caller must hold the paging lock,
+ * which is dropped while reading.
+ */
+int textcache_map(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *pte,
+		  struct vnode *v, off_t offset);
+
+/*
+ * Gives up cached pages to free memory: with any unset, only a page no
+ * process maps; with it set, as many as it takes for a frame to be
+ * freed. Returns true if a frame was freed. Caller must hold the
+ * paging lock.
+ */
+bool textcache_reclaim(bool any);
+
+/* Drops the cached page held in the frame at pa, if any. Caller must
+ * hold the paging lock.
+ */
+void textcache_forget(paddr_t pa);
+
+#endif /* _TEXTCACHE_H_ */
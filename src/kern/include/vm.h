@@ -47,23 +47,141 @@
 #define VM_FAULT_WRITE       1    /* A write was attempted */
 #define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
 
+/*
+ * Page replacement policies, switchable at runtime with cm_set_policy
+ * (the "vmpolicy" menu command). CM_REPLACEMENT is the boot default.
+ *   CM_REPLACE_FIFO    - evict the oldest frame on the allocation chain
+ *   CM_REPLACE_CLOCK   - second chance: sweep the coremap, sparing (and
+ *                        clearing) frames referenced since the last pass
+ *   CM_REPLACE_LRU     - aging approximation of least recently used
+ *   CM_REPLACE_WSCLOCK - clock that keeps frames used within the last
+ *                        CM_WSCLOCK_TAU faults (the working set)
+ *   CM_REPLACE_RANDOM  - any evictable frame
+ */
+#define CM_REPLACE_FIFO		0
+#define CM_REPLACE_CLOCK	1
+#define CM_REPLACE_LRU		2
+#define CM_REPLACE_WSCLOCK	3
+#define CM_REPLACE_RANDOM	4
+#define CM_NUM_POLICIES		5
+#define CM_REPLACEMENT		CM_REPLACE_CLOCK
+
+#define CM_WSCLOCK_TAU		64
+
+/*
+ * Resident set limits. Every load control tick the coremap is sampled
+ * for each address space's working set: the frames it used in the last
+ * CM_WSCLOCK_TAU faults. An address space that owns rssLimit frames
+ * (CM_RSS_LIMIT by default, 0 for none) replaces its own pages rather
+ * than take frames from other processes.
+ */
+#define CM_RSS_LIMIT		0
+
+/*
+ * Load control, checked once a second. Memory is thrashing when at
+ * least CM_THRASH_PAGEINS pages were read from swap in that second,
+ * the cpus were idle at least CM_THRASH_IDLE percent of it, and the
+ * working sets fill all but 1/CM_THRASH_SLACK of the frames user pages
+ * have. Each such second swaps out the largest process, up to
+ * CM_MAX_SUSPENDED at a time, as long as another process faulted too.
+ * A process resumes once its working set fits in free memory again,
+ * when no running process faulted, or after CM_LOAD_MAXWAIT seconds.
+ */
+#define CM_THRASH_PAGEINS	16
+#define CM_THRASH_IDLE		50
+#define CM_THRASH_SLACK		8
+#define CM_MAX_SUSPENDED	4
+#define CM_LOAD_MAXWAIT		10
+
+/*
+ * Page cleaner tuning. The cleaner wakes when fewer than CM_CLEAN_LOW
+ * frames are free and writes back up to CM_CLEAN_BATCH dirty frames
+ * ahead of the clock hand, until CM_CLEAN_TARGET free or clean frames
+ * are ready to be reclaimed without I/O.
+ */
+#define CM_CLEAN_LOW		8
+#define CM_CLEAN_TARGET		32
+#define CM_CLEAN_BATCH		8
+
+/*
+ * While idle, the cleaner also keeps up to CM_ZERO_POOL free frames
+ * zeroed ahead of time for zero-fill faults, as long as more than
+ * CM_CLEAN_TARGET frames are free.
+ */
+#define CM_ZERO_POOL		16
+
+/*
+ * Replacement policy operations, called with the coremap index of a
+ * user frame:
+ *    rp_on_alloc     - frame was given a page (or put back after a
+ *                      failed eviction)
+ *    rp_on_reference - frame's page was loaded into the TLB
+ *    rp_on_free      - frame is being freed or was chosen as a victim
+ *    rp_pick_victim  - set *idxptr to the frame to evict; returns -1
+ *                      if there is no evictable frame
+ */
+struct cm_policy {
+	const char *rp_name;
+	void (*rp_on_alloc)(unsigned idx);
+	void (*rp_on_reference)(unsigned idx);
+	void (*rp_on_free)(unsigned idx);
+	int (*rp_pick_victim)(unsigned *idxptr);
+};
+
+struct addrspace;
+
 struct coremap_entry {
 	pageTableEntry_t *pte; 	// pointer to second level page table pte
+	struct addrspace *as;	// owning address space (user frames only)
+	vaddr_t vaddr;		// user page mapped by this frame
 	/* Generously assumes 2^24 coremap entries exist.
 	 * 25th bit allows -1 value for index.
+	 * prev/next_allocated form the FIFO policy's allocation chain,
+	 * rs_prev/rs_next the owner's resident list (under chain_lock).
 	 */
 	int prev_allocated:25;
 	int next_allocated:25;
+	int rs_prev:25;
+	int rs_next:25;
+	/* Free run bookkeeping, only meaningful while !allocated.
+	 * Free frames are kept in maximal runs of contiguous frames:
+	 * a run's first frame holds its length and list links, its
+	 * last frame points back at the first so neighbors can merge.
+	 */
+	int run_len:25;
+	int run_start:25;
+	int prev_run:25;
+	int next_run:25;
 	int tlb_idx:7;
 	/* bit fields: can only take values 0 or 1 with 1-bit fields */
 	uint32_t allocated:1;
-	uint32_t dirty:1; 		// needed?
+	uint32_t dirty:1; 		// differs from its swap copy (if any)
 	uint32_t more_contig_frames:1;  // 1 if contig-alloc'ed frames remain
 	uint32_t kern:1;
+	uint32_t busy:1;		// being evicted: off the allocation chain
+	uint32_t referenced:1;		// set on TLB refill, cleared by policy
+	uint32_t age:8;			// aging LRU history
+	uint32_t has_swap:1;		// swap_idx holds a copy of this page
+	uint32_t cleaning:1;		// page cleaner is writing it out
+	uint32_t refcount:16;		// page tables mapping it (>1 after fork)
+	uint32_t filebacked:1;		// read from an executable, can reread it
+	uint32_t cached:1;		// one of refcount is the text cache's
+	unsigned last_use;		// fault count at last reference (WSClock)
+	unsigned swap_idx;		// swap block of the copy, if has_swap
 };
 
 struct coremap {
+	/* Protects the free runs */
 	struct spinlock cm_lock;
+	/* Protects the replacement policy state and resident lists; taken
+	 * whenever a user frame gets or loses its owner
+	 */
+	struct spinlock chain_lock;
+	const struct cm_policy *policy;
+	/* Sleep lock serializing page faults, eviction and as teardown;
+	 * held across eviction's swap I/O (the cleaner writes without it)
+	 */
+	struct lock *paging_lock;
 	/* Array of coremap entries */
 	struct coremap_entry *entries;
 	/* First addr managed by coremap */
@@ -71,10 +189,41 @@ struct coremap {
 	/* Indices needed for FIFO eviction */
 	int last_allocated:25;
 	int oldest:25;
+	/* First frame of the first free run, and free frame count */
+	int free_runs:25;
+	unsigned num_free:25;
+	/* Next frame the clock policies look at */
+	unsigned clock_hand:25;
 
 	unsigned num_frames:25;
 };
 
+/* Paging counters, updated under the paging lock */
+struct vm_stats {
+	unsigned vs_faults;		/* TLB faults handled */
+	unsigned vs_zerofills;		/* pages given a fresh zeroed frame */
+	unsigned vs_pgroups;		/* zero-fills done a page group at once */
+	unsigned vs_zeromaps;		/* reads mapped to the shared zero frame */
+	unsigned vs_prezeroed;		/* zero-fills from the pre-zeroed pool */
+	unsigned vs_pageins;		/* pages read back from swap */
+	unsigned vs_evictions;		/* frames pushed out to swap */
+	unsigned vs_clean_evictions;	/* ...of which needed no write */
+	unsigned vs_cleaned;		/* dirty frames written by the cleaner */
+	unsigned vs_clustered;		/* neighbours written with a victim */
+	unsigned vs_readahead;		/* neighbours read in with a fault */
+	unsigned vs_cowcopies;		/* shared frames copied on write */
+	unsigned vs_fileins;		/* pages read from executables */
+	unsigned vs_asidrollovers;	/* times every ASID was handed out */
+	unsigned vs_shootdowns;		/* TLB entries shot down on other cpus */
+	unsigned vs_local_evictions;	/* pages evicted for their own process */
+	unsigned vs_ws_samples;		/* working set samples taken */
+	unsigned vs_suspends;		/* processes swapped out by load control */
+	unsigned vs_resumes;		/* ...and let back in */
+};
+
+/* Prints (and with reset, clears) the paging counters */
+void vm_printstats(bool reset);
+
 /* Coremap initialization function */
 void init_coremap(void);
 
@@ -87,8 +236,17 @@ void vm_bootstrap(void);
  */
 paddr_t getppages(pageTableEntry_t *pte, unsigned long npages);
 
-/* wrapper for single page allocation by non-kernel functions */
-paddr_t cm_alloc_frame(pageTableEntry_t *pte);
+/* wrapper for single page allocation by non-kernel functions. Records
+ * the owning address space and user vaddr so the frame can be evicted.
+ */
+paddr_t cm_alloc_frame(struct addrspace *as, vaddr_t vaddr,
+		       pageTableEntry_t *pte);
+
+/* cm_alloc_frame that evicts until a frame is free; 0 if none can be.
+ * Caller must hold the paging lock.
+ */
+paddr_t cm_alloc_frame_evict(struct addrspace *as, vaddr_t vaddr,
+			     pageTableEntry_t *pte);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) */
 vaddr_t alloc_kpages(unsigned npages);
@@ -98,6 +256,55 @@ void free_kpages(vaddr_t addr);
 /* Free contiguously allocated frames starting at pa */
 int cm_free_frames(paddr_t pa);
 
+/*
+ * Copy-on-write sharing. cm_share_frame adds a page table reference to
+ * the user frame pte maps (at fork); cm_unmap_frame drops the reference
+ * held by *pte and frees the frame with the last one. Caller must hold
+ * the paging lock.
+ */
+void cm_share_frame(pageTableEntry_t pte);
+void cm_unmap_frame(pageTableEntry_t *pte);
+
+/* References held on a user frame by something other than a page table
+ * (the text cache): count them, take one, drop one (freeing with the
+ * last). A cached frame its owner alone maps stays evictable; eviction
+ * has the cache let go of it first.
+ */
+unsigned cm_frame_refcount(paddr_t pa);
+void cm_cache_frame(paddr_t pa);
+void cm_release_frame(paddr_t pa);
+
+/* The frame at pa holds an unmodified page of an executable: evicting
+ * it needs no swap, the fault handler can read it again.
+ */
+void cm_mark_filebacked(paddr_t pa);
+
+/*
+ * Filling a frame from a file happens without the paging lock: file
+ * systems take vfs_biglock, which a thread may hold while it faults on
+ * a user buffer. cm_io_begin marks the frame (just allocated by
+ * cm_alloc_frame_evict) busy, so nothing evicts it, and releases the
+ * lock; cm_io_end takes it back and returns the frame to the
+ * replacement policy. Anything looked up before may have changed.
+ */
+void cm_io_begin(paddr_t pa);
+void cm_io_end(paddr_t pa);
+
+/* Switch page replacement policy by name; EINVAL if unknown */
+int cm_set_policy(const char *name);
+const char *cm_get_policy(void);
+
+/* Default resident set limit, in frames, of address spaces created from
+ * now on (0 for none). Forked address spaces keep their parent's.
+ */
+void vm_set_rss_limit(unsigned frames);
+unsigned vm_get_rss_limit(void);
+
+/* Drops a dying address space from load control and lets suspended
+ * processes check for room. Caller must hold the paging lock.
+ */
+void vm_load_forget(struct addrspace *as);
+
 /*
  * Selects best candidate for eviction. Sets idxptr to frame index to evict,
  * updates allocation chain to reflect victim selection. Returns -1 if no
@@ -106,15 +313,37 @@ int cm_free_frames(paddr_t pa);
 int select_victim(unsigned *idxptr);
 
 /*
- * Uses coremap to evict next victim. Sets pte's value to be the pte whose
- * frame was evicted.
+ * Uses coremap to evict next victim: writes it to swap, points its pte
+ * at the swap block and frees the frame. Caller must hold the paging lock.
+ */
+int evict_frame(void);
+
+/* Paging lock: held across page faults (but for file reads, see
+ * cm_io_begin), eviction and as teardown
+ */
+void cm_paging_acquire(void);
+void cm_paging_release(void);
+
+/* Starts a new software TLB generation: call, holding the paging
+ * lock, after changing or removing mappings across an address space.
+ * (Single pages are dropped by the TLB invalidation in vm.c.)
+ */
+void vm_tlbcache_flush(void);
+
+/* ASIDs: vm_asid_activate loads an address space's ASID on this cpu,
+ * assigning a new one if needed; vm_tlb_flush_as drops every TLB entry
+ * of an address space, the current one by giving it a new ASID, any
+ * other by a shootdown on the cpu its ASID belongs to. Call the latter
+ * without spinlocks held.
  */
-int evict_frame(pageTableEntry_t **pte, unsigned *swap_idx);
+void vm_asid_activate(struct addrspace *as);
+void vm_tlb_flush_as(struct addrspace *as);
 
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
+void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
 
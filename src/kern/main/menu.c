@@ -41,6 +41,7 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
 
@@ -374,6 +375,66 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	if (nargs == 1) {
+		vm_printstats(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		vm_printstats(true);
+	}
+	else {
+		kprintf("Usage: vm [reset]\n");
+		return EINVAL;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmpolicy(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprintf("Page replacement policy: %s\n", cm_get_policy());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmpolicy [fifo|clock|lru|wsclock|random]\n");
+		return EINVAL;
+	}
+
+	result = cm_set_policy(args[1]);
+	if (result) {
+		kprintf("vmpolicy: unknown policy %s\n", args[1]);
+		return result;
+	}
+
+	return 0;
+}
+
+static
+int
+cmd_vmrss(int nargs, char **args)
+{
+	if (nargs == 1) {
+		kprintf("Resident set limit: %u frames\n", vm_get_rss_limit());
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmrss [frames]   (0 for no limit)\n");
+		return EINVAL;
+	}
+
+	vm_set_rss_limit(atoi(args[1]));
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -557,6 +618,9 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
+	{ "vmpolicy",   cmd_vmpolicy },
+	{ "vmrss",      cmd_vmrss },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -34,7 +34,8 @@
  * It makes the following address space calls:
  *    - first, as_define_region once for each segment of the program;
  *    - then, as_prepare_load;
- *    - then it loads each chunk of the program;
+ *    - then as_define_segment for each chunk of the program, whose
+ *      pages are read in lazily by the fault handler;
  *    - finally, as_complete_load.
  *
  * This gives the VM code enough flexibility to deal with even grossly
@@ -42,9 +43,6 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
- *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
  * linker). And you'd have to write a dynamic linker...
@@ -60,91 +58,6 @@
 #include <vnode.h>
 #include <elf.h>
 
-/*
- * Load a segment at virtual address VADDR. The segment in memory
- * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
- * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
- *
- * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
- *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
- */
-static
-int
-load_segment(struct addrspace *as, struct vnode *v,
-	     off_t offset, vaddr_t vaddr,
-	     size_t memsize, size_t filesize,
-	     int is_executable)
-{
-	struct iovec iov;
-	struct uio u;
-	int result;
-
-	if (filesize > memsize) {
-		kprintf("ELF: warning: segment filesize > segment memsize\n");
-		filesize = memsize;
-	}
-
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-	      (unsigned long) filesize, (unsigned long) vaddr);
-
-	iov.iov_ubase = (userptr_t)vaddr;
-	iov.iov_len = memsize;		 // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize;          // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = is_executable ? UIO_USERISPACE : UIO_USERSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = as;
-
-	result = VOP_READ(v, &u);
-	if (result) {
-		return result;
-	}
-
-	if (u.uio_resid != 0) {
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
-	}
-
-	/*
-	 * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.
-	 */
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0) {
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-			      (unsigned long) fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-
-	return result;
-}
-
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -259,7 +172,9 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	}
 
 	/*
-	 * Now actually load each segment.
+	 * Now record where each segment comes from. Nothing is read
+	 * yet: vm_fault reads each page from the file when it is first
+	 * touched, and the part past p_filesz (the bss) is zero-filled.
 	 */
 
 	for (i=0; i<eh.e_phnum; i++) {
@@ -288,9 +203,17 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
-				      ph.p_memsz, ph.p_filesz,
-				      ph.p_flags & PF_X);
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+		}
+
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes to 0x%lx\n",
+		      (unsigned long) ph.p_filesz, (unsigned long) ph.p_vaddr);
+
+		result = as_define_segment(as, v, ph.p_offset, ph.p_vaddr,
+					   ph.p_memsz, ph.p_filesz,
+					   (ph.p_flags & PF_X) &&
+					   !(ph.p_flags & PF_W));
 		if (result) {
 			return result;
 		}
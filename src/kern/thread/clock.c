@@ -97,6 +97,9 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	if (curcpu->c_isidle) {
+		curcpu->c_idleclocks++;
+	}
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
 		thread_consider_migration();
 	}
@@ -165,6 +165,7 @@ cpu_create(unsigned hardware_number)
 {
 	struct cpu *c;
 	int result;
+	unsigned i;
 	char namebuf[16];
 
 	c = kmalloc(sizeof(*c));
@@ -178,6 +179,15 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_numframes = 0;
+	for (i=0; i<VM_TLBCACHE_SIZE; i++) {
+		c->c_tlbcache[i].tc_gen = 0;
+	}
+	c->c_tlbcache_hits = 0;
+	c->c_tlbcache_misses = 0;
+	c->c_asid = 0;
+	c->c_asidgen = 0;
 	c->c_spinlocks = 0;
 
 	c->c_isidle = false;
@@ -186,6 +196,7 @@ cpu_create(unsigned hardware_number)
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_all = false;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -1113,6 +1124,30 @@ ipi_send(struct cpu *target, int code)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+void
+cpu_clocks(unsigned *hardclocks, unsigned *idleclocks)
+{
+	unsigned i;
+	struct cpu *c;
+
+	*hardclocks = 0;
+	*idleclocks = 0;
+	for (i=0; i < cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		*hardclocks += c->c_hardclocks;
+		*idleclocks += c->c_idleclocks;
+	}
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	if (num >= cpuarray_num(&allcpus)) {
+		return NULL;
+	}
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Send an IPI to all CPUs.
  */
@@ -1142,16 +1177,8 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 
 	n = target->c_numshootdown;
 	if (n == TLBSHOOTDOWN_MAX) {
-		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
-		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+		/* Too many to do one by one; flush the whole TLB instead */
+		target->c_shootdown_all = true;
 	}
 	else {
 		target->c_shootdown[n] = *mapping;
@@ -1164,6 +1191,25 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Wait for a TLB shootdown to finish. The queue only empties once the
+ * target has handled everything in it, ours included.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target)
+{
+	bool done;
+
+	KASSERT(curthread->t_iplhigh_count == 0);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = target->c_numshootdown == 0 &&
+			!target->c_shootdown_all;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
@@ -1205,10 +1251,16 @@ interprocessor_interrupt(void)
 		 * need to release the ipi lock while calling
 		 * vm_tlbshootdown.
 		 */
-		for (i=0; i<curcpu->c_numshootdown; i++) {
-			vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		if (curcpu->c_shootdown_all) {
+			vm_tlbshootdown_all();
+		}
+		else {
+			for (i=0; i<curcpu->c_numshootdown; i++) {
+				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_all = false;
 	}
 
 	curcpu->c_ipi_pending = 0;
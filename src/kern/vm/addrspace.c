@@ -29,17 +29,19 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <proc.h>
 
-#include <spl.h>
 #include <cpu.h>
 #include <spinlock.h>
 #include <current.h>
-#include <mips/tlb.h>
 #include <copyinout.h>
+#include <swap.h>
+#include <uio.h>
+#include <vnode.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -47,6 +49,73 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+static pageTableEntry_t *as_new_directory_frame(struct addrspace *as, vaddr_t vaddr);
+
+/*
+ * Second level page tables come from their own slab: tables freed when
+ * they empty are kept, up to PT_SLAB_MAX of them, and handed out again
+ * before asking the coremap, so a heap that grows and shrinks doesn't
+ * churn kernel pages. as_pt_reclaim gives them back under pressure.
+ */
+#define PT_SLAB_MAX 8
+
+static struct spinlock pt_slab_lock = SPINLOCK_INITIALIZER;
+static vaddr_t pt_slab[PT_SLAB_MAX];
+static unsigned pt_slab_count;
+
+static
+pageTableEntry_t *
+pt_alloc(void)
+{
+	vaddr_t pgTblVaddr = 0;
+
+	spinlock_acquire(&pt_slab_lock);
+	if (pt_slab_count > 0)
+		pgTblVaddr = pt_slab[--pt_slab_count];
+	spinlock_release(&pt_slab_lock);
+
+	// page tables are kernel frames so they are never evicted
+	if (pgTblVaddr == 0)
+		pgTblVaddr = alloc_kpages(1);
+	if (pgTblVaddr == 0)
+		return NULL;
+
+	bzero((void *)pgTblVaddr, PAGE_SIZE);
+	return (pageTableEntry_t *)pgTblVaddr;
+}
+
+static
+void
+pt_free(pageTableEntry_t *pgTbl)
+{
+	spinlock_acquire(&pt_slab_lock);
+	if (pt_slab_count < PT_SLAB_MAX)
+	{
+		pt_slab[pt_slab_count++] = (vaddr_t)pgTbl;
+		pgTbl = NULL;
+	}
+	spinlock_release(&pt_slab_lock);
+
+	if (pgTbl != NULL)
+		free_kpages((vaddr_t)pgTbl);
+}
+
+bool
+as_pt_reclaim(void)
+{
+	vaddr_t pgTblVaddr = 0;
+
+	spinlock_acquire(&pt_slab_lock);
+	if (pt_slab_count > 0)
+		pgTblVaddr = pt_slab[--pt_slab_count];
+	spinlock_release(&pt_slab_lock);
+
+	if (pgTblVaddr == 0)
+		return false;
+	free_kpages(pgTblVaddr);
+	return true;
+}
+
 struct addrspace *
 as_create(void)
 {
@@ -59,13 +128,35 @@ as_create(void)
 
 	// Set the stack (grows down) to be PAGE_TABLE_ENTRIES
 	as->stackPtr =  USERSTACK;
-	as->textTopPtr = (vaddr_t)MAKE_PG_TBL_ADDR(PAGE_TABLE_ENTRIES-1);
+	// the heap never starts below the first page, so NULL stays unmapped
+	as->textTopPtr = PAGE_SIZE;
 	as->heapPtr = 0;
-
-	 // set all pageTable pointers to -1
+	as->numRegions = 0;
+	as->asid = 0;
+	as->asidGen = 0;
+	as->asidCpu = NULL;
+	as->rss = 0;
+	as->rssLimit = vm_get_rss_limit();
+	as->rsFirst = -1;
+	as->wss = 0;
+	as->wsGen = 0;
+	as->suspended = false;
+	as->suspendTick = 0;
+	as->faultTick = 0;
+
+	 // no pageTables yet - they are made as their first page is defined
 	 as->pgDirectoryPtr = (pageTableEntry_t *)kmalloc(PAGE_SIZE);
-	 for (int dirIdx = 0; dirIdx < PAGE_TABLE_ENTRIES; dirIdx++)
+	 as->pgTblLive = kmalloc(PAGE_TABLE_ENTRIES * sizeof(uint16_t));
+	 if (as->pgDirectoryPtr == NULL || as->pgTblLive == NULL) {
+		kfree(as->pgDirectoryPtr);
+		kfree(as->pgTblLive);
+		kfree(as);
+		return NULL;
+	 }
+	 for (int dirIdx = 0; dirIdx < PAGE_TABLE_ENTRIES; dirIdx++) {
 	 	as->pgDirectoryPtr[dirIdx] = 0;
+		as->pgTblLive[dirIdx] = 0;
+	 }
 
 	//	kprintf("A new addrspace! (%p)\n", as->pgDirectoryPtr);
 	return as;
@@ -81,32 +172,60 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	/* not really sure how to make a deep copy given that I'm using the same vaddr_t
-	newas->pgDirectoryPtr = (pageTableEntry_t *)kmalloc(PAGE_SIZE);
-	for (int dirIdx = 0; dirIdx < PAGE_TABLE_ENTRIES; dirIdx++)
-	{
-		if (old->pgDirectoryPtr[dirIdx].isUsed)
-		{
-				new->pgDirectoryPtr[dirIdx].physicalAddress = cm_alloc_frame(vaddr_t);
-				new->pgDirectoryPtr[dirIdx].isUsed = 1;
-				for (int pgIdx = 0; pgIdx < PAGE_TABLE_ENTRIES; pgIdx++)
-				{
-					pageTableEntry_t *pageTablePtr = MAKE_VADDR(dirIdx,pgIdx,0);
-					if (pageTablePtr[pgIdx].isUsed)
-					{
-						// get paddr_t for allocating actual pageTable
-						// save it in the page table entry
-						// memcpy the actual contents of the page from the original location
-					} // check if pageTable entry used
-				} // loop over pageTable entires
-		} // check if directoryTable entry used
-	} // loop over directoryTable entries
-	*/
-	 newas->pgDirectoryPtr = old->pgDirectoryPtr;
-
 	 newas->stackPtr = old->stackPtr;
 	 newas->textTopPtr = old->textTopPtr;
 	 newas->heapPtr = old->heapPtr;
+	 newas->rssLimit = old->rssLimit;
+
+	// lazily loaded pages read from the same executable
+	for (unsigned rgnIdx = 0; rgnIdx < old->numRegions; rgnIdx++)
+	{
+		newas->regions[rgnIdx] = old->regions[rgnIdx];
+		if (newas->regions[rgnIdx].rgnVnode != NULL)
+			VOP_INCREF(newas->regions[rgnIdx].rgnVnode);
+	}
+	newas->numRegions = old->numRegions;
+
+	// only the page tables are copied: both address spaces share every
+	// frame and swap block copy-on-write (see vm_cow_fault)
+	cm_paging_acquire();
+
+	for (int32_t dirIdx = 0; dirIdx < PAGE_TABLE_ENTRIES; dirIdx++)
+	{
+		if (!IS_USED_PAGE(old->pgDirectoryPtr[dirIdx]))
+			continue;
+
+		pageTableEntry_t *newTbl = as_new_directory_frame(newas, MAKE_VADDR(dirIdx, 0, 0));
+		if (newTbl == NULL)
+		{
+			cm_paging_release();
+			as_destroy(newas);
+			return ENOMEM;
+		}
+
+		// read after the allocation, which may have evicted some of these
+		pageTableEntry_t *oldTbl = PTE_TO_KPG_TBL(old->pgDirectoryPtr[dirIdx]);
+		for (int32_t pgIdx = 0; pgIdx < PAGE_TABLE_ENTRIES; pgIdx++)
+		{
+			if (IS_USED_PAGE(oldTbl[pgIdx]))
+			{
+				cm_share_frame(oldTbl[pgIdx]);
+				oldTbl[pgIdx] |= COW_BIT;
+			}
+			else if (IS_ON_DISK(oldTbl[pgIdx]))
+				swap_share(PTE_SWAP_BLOCK(oldTbl[pgIdx]));
+
+			newTbl[pgIdx] = oldTbl[pgIdx];
+		}
+		newas->pgTblLive[dirIdx] = old->pgTblLive[dirIdx];
+	}
+
+	// cached translations of the parent may still be writable
+	vm_tlbcache_flush();
+	cm_paging_release();
+
+	// the parent may still have writable TLB entries for shared frames
+	vm_tlb_flush_as(old);
 
 	*ret = newas;
 	return 0;
@@ -115,38 +234,55 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
+	// keep the evictor from paging out frames while we free them
+	cm_paging_acquire();
+
 	for (int32_t dirIdx = 0; dirIdx < PAGE_TABLE_ENTRIES; dirIdx++)
 	{
 		if (!IS_USED_PAGE(as->pgDirectoryPtr[dirIdx]))
 			continue;
 
-		// release each frame
+		// release each frame or swap block
+		pageTableEntry_t *pgTbl = PTE_TO_KPG_TBL(as->pgDirectoryPtr[dirIdx]);
 		for (int32_t pgIdx = 0; pgIdx < PAGE_TABLE_ENTRIES; pgIdx++)
 		{
-				pageTableEntry_t *pgTbl = MAKE_PTE_ADDR(dirIdx, pgIdx, 0);
-				if (!IS_USED_PAGE(*pgTbl))
-					continue;
-
-				cm_free_frames(PG_ADRS(*pgTbl));
+				if (IS_USED_PAGE(pgTbl[pgIdx]))
+					cm_unmap_frame(&pgTbl[pgIdx]);
+				else if (IS_ON_DISK(pgTbl[pgIdx]))
+					clear_map_block(PTE_SWAP_BLOCK(pgTbl[pgIdx]));
 		}
 
 		// release each pageTable
-		pageTableEntry_t *pgTbl = MAKE_PTE_ADDR(dirIdx, 0, 0);
-		cm_free_frames(PG_ADRS(*pgTbl));
+		pt_free(pgTbl);
 	}
 
+	vm_load_forget(as);
+
+	// the next addrspace may be allocated at the same address
+	vm_tlbcache_flush();
+	cm_paging_release();
+
+	// release the executables
+	for (unsigned rgnIdx = 0; rgnIdx < as->numRegions; rgnIdx++)
+		if (as->regions[rgnIdx].rgnVnode != NULL)
+			VOP_DECREF(as->regions[rgnIdx].rgnVnode);
+
 	// release directory
 	kfree(as->pgDirectoryPtr);
+	kfree(as->pgTblLive);
 
 	// release addrspace
 	kfree(as);
 }
 
-/* copied from dumbvm - just clears TLB */
+/*
+ * Switches the TLB over to the address space by loading its ASID; the
+ * entries of other address spaces stay resident for when they come
+ * back.
+ */
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -154,14 +290,7 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	vm_asid_activate(as);
 }
 
 void
@@ -183,142 +312,595 @@ as_new_directory_frame(struct addrspace *as, vaddr_t vaddr)
 		// if this dirTbl entry isn't initialized -- set it
 		if (!IS_USED_PAGE(as->pgDirectoryPtr[dirIdx]))
 		{
-			paddr_t paddr = cm_alloc_frame(MAKE_PG_TBL_ADDR(dirIdx));
-			as->pgDirectoryPtr[dirIdx] = MAKE_PTE(paddr, USED_BIT);
-
-			// copy this into every entry of the page
-			pageTableEntry_t *pgTblPtr = PTE_TO_KPG_TBL(as->pgDirectoryPtr[dirIdx]);
-			for (int idx = 0; idx < PAGE_TABLE_ENTRIES; idx++)
-				 pgTblPtr[idx] = 0;
+			pageTableEntry_t *pgTblPtr = pt_alloc();
+			if (pgTblPtr == NULL)
+				return NULL;
+			as->pgDirectoryPtr[dirIdx] = MAKE_PTE(KVADDR_TO_PADDR((vaddr_t)pgTblPtr), USED_BIT);
+			as->pgTblLive[dirIdx] = 0;
 		}
 
 		return PTE_TO_KPG_TBL(as->pgDirectoryPtr[dirIdx]);
 }
 
+pageTableEntry_t *
+as_lookup_pte(struct addrspace *as, vaddr_t vaddr, bool create)
+{
+	int32_t dirIdx = DIR_TBL_OFFSET(vaddr);
+	pageTableEntry_t *pgTblPtr;
+
+	if (IS_USED_PAGE(as->pgDirectoryPtr[dirIdx]))
+		pgTblPtr = PTE_TO_KPG_TBL(as->pgDirectoryPtr[dirIdx]);
+	else if (create)
+		pgTblPtr = as_new_directory_frame(as, vaddr);
+	else
+		return NULL;
+
+	if (pgTblPtr == NULL)
+		return NULL;
+
+	return &pgTblPtr[PG_TBL_OFFSET(vaddr)];
+}
+
+pageTableEntry_t *
+as_define_pte(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t perms)
+{
+	KASSERT(perms != 0);
+
+	pageTableEntry_t *pte = as_lookup_pte(as, vaddr, true);
+	if (pte != NULL && *pte == 0)
+	{
+		*pte = perms;
+		as->pgTblLive[DIR_TBL_OFFSET(vaddr)]++;
+	}
+	return pte;
+}
+
+void
+as_unmap_range(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	KASSERT(start % PAGE_SIZE == 0 && end % PAGE_SIZE == 0);
+	KASSERT(end <= USERSPACETOP);
+
+	cm_paging_acquire();
+
+	for (vaddr_t vaddr = start; vaddr < end && vaddr >= start; vaddr += PAGE_SIZE)
+	{
+		int32_t dirIdx = DIR_TBL_OFFSET(vaddr);
+		if (!IS_USED_PAGE(as->pgDirectoryPtr[dirIdx]))
+		{
+			// nothing in this 4M span: skip to the next one
+			vaddr = MAKE_VADDR(dirIdx + 1, 0, 0) - PAGE_SIZE;
+			continue;
+		}
+
+		pageTableEntry_t *pgTbl = PTE_TO_KPG_TBL(as->pgDirectoryPtr[dirIdx]);
+		pageTableEntry_t *pte = &pgTbl[PG_TBL_OFFSET(vaddr)];
+		if (*pte == 0)
+			continue;
+
+		if (IS_USED_PAGE(*pte))
+			cm_unmap_frame(pte);
+		else if (IS_ON_DISK(*pte))
+			clear_map_block(PTE_SWAP_BLOCK(*pte));
+		*pte = 0;
+
+		// the last live entry takes its pageTable with it
+		KASSERT(as->pgTblLive[dirIdx] > 0);
+		if (--as->pgTblLive[dirIdx] == 0)
+		{
+			as->pgDirectoryPtr[dirIdx] = 0;
+			pt_free(pgTbl);
+		}
+	}
+
+	vm_tlbcache_flush();
+	cm_paging_release();
+
+	// drop any TLB entries for the unmapped pages
+	vm_tlb_flush_as(as);
+}
+
+bool
+as_is_anonymous(struct addrspace *as, vaddr_t vaddr)
+{
+	// heap grows up from the end of the loaded segments
+	if (vaddr >= as->textTopPtr && vaddr < as->heapPtr)
+		return true;
+
+	// stack grows down from stackPtr
+	if (vaddr < as->stackPtr &&
+	    vaddr >= as->stackPtr - VM_STACKPAGES * PAGE_SIZE)
+		return true;
+
+	return false;
+}
+
 /*
- * Set up a segment at virtual address VADDR of size MEMSIZE. The
- * segment in memory extends from VADDR up to (but not including)
- * VADDR+MEMSIZE.
- *
- * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
- * write, or execute permission should be set on the segment. At the
- * moment, these are ignored. When you write the VM system, you may
- * want to implement them.
+ * Index of the first region ending above vaddr (numRegions if none).
+ * Regions are sorted and disjoint, so their ends are sorted too and a
+ * binary search finds it.
  */
+static
+unsigned
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo = 0, hi = as->numRegions;
+
+	while (lo < hi)
+	{
+		unsigned mid = (lo + hi) / 2;
+		struct as_region *rgn = &as->regions[mid];
+		if (rgn->rgnBase + rgn->rgnSize <= vaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+// iterate over the regions overlapping the page at vaddr
+#define FOR_EACH_PAGE_REGION(as, vaddr, rgn) \
+	for (unsigned _rgnIdx = as_find_region(as, vaddr); \
+	     _rgnIdx < (as)->numRegions && \
+	     ((rgn) = &(as)->regions[_rgnIdx])->rgnBase < (vaddr) + PAGE_SIZE; \
+	     _rgnIdx++)
+
 int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
-		 int readable, int writeable, int executable)
+as_define_segment(struct addrspace *as, struct vnode *v, off_t offset,
+		  vaddr_t vaddr, size_t memsize, size_t filesize, bool text)
+{
+	// the region as_define_region made for this segment
+	unsigned rgnIdx = as_find_region(as, vaddr);
+	if (rgnIdx == as->numRegions || as->regions[rgnIdx].rgnBase != vaddr ||
+	    as->regions[rgnIdx].rgnSize != memsize)
+		return EINVAL;
+
+	struct as_region *rgn = &as->regions[rgnIdx];
+	if (rgn->rgnVnode != NULL)
+		return EINVAL;
+	rgn->rgnVnode = v;
+	rgn->rgnOffset = offset;
+	rgn->rgnFileSize = filesize < memsize ? filesize : memsize;
+	rgn->rgnText = text;
+	VOP_INCREF(v);
+
+	return 0;
+}
+
+bool
+as_region_perms(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *permsp)
 {
-	// Align the region. First, the base...
-	memsize += vaddr & ~(vaddr_t)PAGE_FRAME;
+	struct as_region *rgn;
+	bool found = false;
+
+	// a page shared by two segments gets both their permissions
 	vaddr &= PAGE_FRAME;
+	*permsp = 0;
+	FOR_EACH_PAGE_REGION(as, vaddr, rgn)
+	{
+		*permsp |= rgn->rgnPerms;
+		found = true;
+	}
+	return found;
+}
 
-	// ...and now the length.
-	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
-	size_t npages = memsize / PAGE_SIZE;
+// true if [vaddr, vaddr + PAGE_SIZE) overlaps rgn's file contents
+static
+bool
+as_region_file_overlaps(struct as_region *rgn, vaddr_t vaddr)
+{
+	return rgn->rgnVnode != NULL &&
+	       rgn->rgnBase < vaddr + PAGE_SIZE &&
+	       vaddr < rgn->rgnBase + rgn->rgnFileSize;
+}
 
-	// freak out if this memory is already used for page tables
-	if (vaddr < (vaddr_t)MAKE_PG_TBL_ADDR(PAGE_TABLE_ENTRIES-1))
-		return ENOSYS;
+bool
+as_is_file_backed(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_region *rgn;
+
+	vaddr &= PAGE_FRAME;
+	FOR_EACH_PAGE_REGION(as, vaddr, rgn)
+		if (as_region_file_overlaps(rgn, vaddr))
+			return true;
+	return false;
+}
 
-	// create a PTE with permissions set - not used yet
-	pageTableEntry_t pte = 0;
-	if (readable) pte += READ_BIT;
-	if (writeable) pte += WRITE_BIT;
-	if (executable) pte += EXECUTE_BIT;
+int
+as_read_page(struct addrspace *as, vaddr_t vaddr, void *kbuf)
+{
+	struct as_region *rgn;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	vaddr &= PAGE_FRAME;
+	bzero(kbuf, PAGE_SIZE);
 
-	// heap grows up
-	for (size_t idx = 0; idx < npages; idx++)
+	// segments may share a page at their ends: copy in each one's part
+	FOR_EACH_PAGE_REGION(as, vaddr, rgn)
 	{
-		// if this dirTbl entry isn't initialized -- set it
-		pageTableEntry_t *pgTblPtr = as_new_directory_frame(as, vaddr);
-		int32_t pgIdx = PG_TBL_OFFSET(vaddr);
+		if (!as_region_file_overlaps(rgn, vaddr))
+			continue;
 
-		// freak out if this pte is already used
-		if (IS_USED_PAGE(pgTblPtr[pgIdx]))
-			return ENOSYS;
+		vaddr_t start = rgn->rgnBase > vaddr ? rgn->rgnBase : vaddr;
+		vaddr_t end = rgn->rgnBase + rgn->rgnFileSize;
+		if (end > vaddr + PAGE_SIZE)
+			end = vaddr + PAGE_SIZE;
+
+		uio_kinit(&iov, &u, (char *)kbuf + (start - vaddr), end - start,
+			  rgn->rgnOffset + (start - rgn->rgnBase), UIO_READ);
+		result = VOP_READ(rgn->rgnVnode, &u);
+		if (result)
+			return result;
+		if (u.uio_resid != 0)
+		{
+			kprintf("ELF: short read on segment - file truncated?\n");
+			return ENOEXEC;
+		}
+	}
+	return 0;
+}
 
-		// add the permission bits to the pgTbl entry
-		// - even though it doesn't have it's paddr_t part yet
-		pgTblPtr[pgIdx] = pte;
+bool
+as_text_page(struct addrspace *as, vaddr_t vaddr, struct vnode **vp,
+	     off_t *offsetp)
+{
+	struct as_region *rgn, *text = NULL;
 
-		// and recalc for the next page
-		vaddr += PAGE_SIZE;
+	vaddr &= PAGE_FRAME;
+	FOR_EACH_PAGE_REGION(as, vaddr, rgn)
+	{
+		// a page anything else touches is private
+		if (text != NULL || !rgn->rgnText ||
+		    rgn->rgnBase > vaddr ||
+		    vaddr + PAGE_SIZE > rgn->rgnBase + rgn->rgnFileSize)
+			return false;
+		text = rgn;
 	}
+	if (text == NULL)
+		return false;
 
-	// keep track of where this section ends
-	 int32_t dirIdx = DIR_TBL_OFFSET(vaddr);
-	 int32_t pgIdx = PG_TBL_OFFSET(vaddr);
-	 as->textTopPtr = MAKE_VADDR(dirIdx, pgIdx, 0);
-	 return 0;
+	*vp = text->rgnVnode;
+	*offsetp = text->rgnOffset + (vaddr - text->rgnBase);
+	return true;
 }
 
+/*
+ * Set up a segment at virtual address VADDR of size MEMSIZE. The
+ * segment in memory extends from VADDR up to (but not including)
+ * VADDR+MEMSIZE.
+ *
+ * The READABLE, WRITEABLE, and EXECUTABLE flags are set if read,
+ * write, or execute permission should be set on the segment. They are
+ * kept in the region and copied into each page's PTE when vm_fault
+ * first maps it, so defining a region costs the same at any size.
+ */
+// add an anonymous region, keeping them sorted; NULL if there is no room
 static
-void
-as_allocate_page(struct addrspace *as, int dirIdx, int pgIdx)
+struct as_region *
+as_insert_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		 pageTableEntry_t perms)
 {
-		// grab the right page table
-		pageTableEntry_t *pgTblPtr = PTE_TO_KPG_TBL(as->pgDirectoryPtr[dirIdx]);
+	unsigned rgnIdx = as_find_region(as, vaddr);
 
-		// mark this page as used (add to existing permissions bytes)
-		pgTblPtr[pgIdx] += USED_BIT;
+	if (as->numRegions == AS_MAXREGIONS)
+		return NULL;
 
-		// get virtual page # & save assigned paddr_t
-		pageTableEntry_t *page = MAKE_PTE_ADDR(dirIdx, pgIdx, 0);
-		paddr_t physicalAddress = cm_alloc_frame(page);
-		pgTblPtr[pgIdx] += physicalAddress;
+	// keep them sorted - the page tables are filled in by vm_fault
+	for (unsigned idx = as->numRegions; idx > rgnIdx; idx--)
+		as->regions[idx] = as->regions[idx - 1];
+	as->numRegions++;
+
+	struct as_region *rgn = &as->regions[rgnIdx];
+	rgn->rgnBase = vaddr;
+	rgn->rgnSize = memsize;
+	rgn->rgnPerms = perms;
+	rgn->rgnVnode = NULL;
+	rgn->rgnOffset = 0;
+	rgn->rgnFileSize = 0;
+	rgn->rgnText = false;
+	rgn->rgnShared = false;
+	return rgn;
 }
 
-/* assumes text region starts at 0 and grows to textTopPtr */
+static
+void
+as_remove_region(struct addrspace *as, unsigned rgnIdx)
+{
+	if (as->regions[rgnIdx].rgnVnode != NULL)
+		VOP_DECREF(as->regions[rgnIdx].rgnVnode);
+
+	as->numRegions--;
+	for (unsigned idx = rgnIdx; idx < as->numRegions; idx++)
+		as->regions[idx] = as->regions[idx + 1];
+}
+
+// split the region strictly containing vaddr, if any, in two at vaddr
+static
 int
-as_prepare_load(struct addrspace *as)
+as_split_region(struct addrspace *as, vaddr_t vaddr)
 {
-	// get starting values in our directory & page tables
-	int32_t dirMax = DIR_TBL_OFFSET(as->textTopPtr);
-	int32_t pgMax = PG_TBL_OFFSET(as->textTopPtr);
+	unsigned rgnIdx = as_find_region(as, vaddr);
+	if (rgnIdx == as->numRegions || as->regions[rgnIdx].rgnBase >= vaddr)
+		return 0;
 
-	// dir 0 reserved for page table allocation - skip it
-	for (int32_t dirIdx = 1; dirIdx < dirMax; dirIdx++)
-	{
-		if (!IS_USED_PAGE(as->pgDirectoryPtr[dirIdx]))
-			continue;
+	if (as->numRegions == AS_MAXREGIONS)
+		return ENOMEM;
 
-		// allocate each frame
-		for (int32_t pgIdx = 0; pgIdx < PAGE_TABLE_ENTRIES; pgIdx++)
-			as_allocate_page(as, dirIdx, pgIdx);
+	// the head keeps the file contents before vaddr, the tail the rest
+	struct as_region old = as->regions[rgnIdx];
+	size_t headSize = vaddr - old.rgnBase;
+	as->regions[rgnIdx].rgnSize = headSize;
+	if (old.rgnFileSize > headSize)
+		as->regions[rgnIdx].rgnFileSize = headSize;
+
+	struct as_region *tail = as_insert_region(as, vaddr,
+						  old.rgnSize - headSize,
+						  old.rgnPerms);
+	KASSERT(tail != NULL);
+	if (old.rgnVnode != NULL)
+	{
+		tail->rgnVnode = old.rgnVnode;
+		tail->rgnOffset = old.rgnOffset + headSize;
+		tail->rgnFileSize = old.rgnFileSize > headSize ?
+				    old.rgnFileSize - headSize : 0;
+		tail->rgnText = old.rgnText;
+		VOP_INCREF(old.rgnVnode);
 	}
+	tail->rgnShared = old.rgnShared;
+	return 0;
+}
 
-	// allocate each frame - final pgTbl may not use all entries
-	for (int32_t pgIdx = 0; pgIdx <= pgMax; pgIdx++)
-		as_allocate_page(as, dirMax, pgIdx);
-
- return 0;
+// true if any region overlaps [start, end)
+bool
+as_range_mapped(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	unsigned rgnIdx = as_find_region(as, start);
+	return rgnIdx < as->numRegions && as->regions[rgnIdx].rgnBase < end;
 }
 
 int
-as_complete_load(struct addrspace *as)
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+		 int readable, int writeable, int executable)
 {
-	/*
-	 * Write this. - not actually sure there is anything to do here
-	 */
+	pageTableEntry_t perms = 0;
+
+	// keep NULL dereferences faulting
+	if (vaddr < PAGE_SIZE)
+		return EINVAL;
+	if (memsize == 0 || vaddr + memsize < vaddr || vaddr + memsize > USERSPACETOP)
+		return EINVAL;
+
+	// regions may share a page but not bytes
+	if (as_range_mapped(as, vaddr, vaddr + memsize))
+		return ENOSYS;
 
+	if (readable) perms += READ_BIT;
+	if (writeable) perms += WRITE_BIT;
+	if (executable) perms += EXECUTE_BIT;
+	if (as_insert_region(as, vaddr, memsize, perms) == NULL)
+		return ENOMEM;
+
+	// keep track of where the highest section ends
+	vaddr_t top = ROUNDUP(vaddr + memsize, PAGE_SIZE);
+	if (top > as->textTopPtr)
+		as->textTopPtr = top;
+	return 0;
+}
+
+/*
+ * Frames are no longer allocated up front, and load_elf only defines
+ * segments: vm_fault reads their pages in on first touch, so nothing
+ * is written to the address space while loading.
+ */
+int
+as_prepare_load(struct addrspace *as)
+{
 	(void)as;
 	return 0;
 }
 
+int
+as_complete_load(struct addrspace *as)
+{
+	// the heap starts right after the last loaded segment
+	as->heapPtr = as->textTopPtr;
+	return 0;
+}
+
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	// stack grows down - allocate a page table for it to start.
+	// stack grows down - its pages are zero-filled by vm_fault as
+	// they are touched, see as_is_anonymous
 	*stackptr = as->stackPtr;
 
-	// if this dirTbl entry isn't initialized -- set it
-	pageTableEntry_t *pgTblPtr = as_new_directory_frame(as, *stackptr);
+	return 0;
+}
 
-	// freak out if this pte is already used
-	uint32_t pgIdx = PG_TBL_OFFSET(*stackptr);
-	if (IS_USED_PAGE(pgTblPtr[pgIdx]))
-		return ENOSYS;
+/*
+ * Memory mappings. A mapping is an anonymous region, zero-filled as it
+ * is touched and placed top-down below the stack unless MAP_FIXED says
+ * where. There is no file table to find an fd's vnode in, so there are
+ * no file mappings; that keeps the text cache, which assumes its files
+ * never change, to executables. Nothing is shared between processes,
+ * so MAP_SHARED mappings can't be writable. Only this process changes
+ * its regions, so they need no lock; page table changes take the
+ * paging lock as usual.
+ */
+
+static
+pageTableEntry_t
+as_prot_perms(int prot)
+{
+	pageTableEntry_t perms = 0;
+
+	if (prot & PROT_READ) perms += READ_BIT;
+	if (prot & PROT_WRITE) perms += WRITE_BIT;
+	if (prot & PROT_EXEC) perms += EXECUTE_BIT;
+	return perms;
+}
+
+// check [addr, addr + len) and hand back its page aligned end
+static
+int
+as_check_range(vaddr_t addr, size_t len, vaddr_t *endp)
+{
+	if (addr % PAGE_SIZE != 0 || addr < PAGE_SIZE || len == 0)
+		return EINVAL;
+	if (len > USERSPACETOP - addr)
+		return EINVAL;
+
+	*endp = addr + ROUNDUP(len, PAGE_SIZE);
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int prot, int flags,
+	vaddr_t *retp)
+{
+	vaddr_t stackBottom = as->stackPtr - VM_STACKPAGES * PAGE_SIZE;
+	vaddr_t end, top;
+	int result;
+
+	if (len == 0 || len > stackBottom ||
+	    (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+		return EINVAL;
+	// exactly one of MAP_SHARED and MAP_PRIVATE
+	if (((flags & MAP_SHARED) != 0) == ((flags & MAP_PRIVATE) != 0))
+		return EINVAL;
+	if ((flags & MAP_SHARED) && (prot & PROT_WRITE))
+		return ENOTSUP;
+	len = ROUNDUP(len, PAGE_SIZE);
+
+	if (flags & MAP_FIXED)
+	{
+		result = as_check_range(addr, len, &end);
+		if (result)
+			return result;
+
+		// the heap and stack have no regions to replace
+		if ((addr < as->heapPtr && end > as->textTopPtr) ||
+		    (addr < as->stackPtr && end > stackBottom))
+			return EINVAL;
+
+		// anything else mapped there is replaced
+		result = as_munmap(as, addr, len);
+		if (result)
+			return result;
+	}
+	else
+	{
+		// the highest gap below the stack that fits
+		top = stackBottom;
+		for (unsigned idx = as->numRegions; idx > 0; idx--)
+		{
+			struct as_region *rgn = &as->regions[idx - 1];
+			if (rgn->rgnBase >= top)
+				continue;
+			if (len <= top &&
+			    ROUNDUP(rgn->rgnBase + rgn->rgnSize, PAGE_SIZE) <= top - len)
+				break;
+			top = rgn->rgnBase & PAGE_FRAME;
+		}
+		// leaving the heap whatever is below
+		if (len > top || top - len < as->heapPtr)
+			return ENOMEM;
+		addr = top - len;
+	}
+
+	struct as_region *rgn = as_insert_region(as, addr, len,
+						 as_prot_perms(prot));
+	if (rgn == NULL)
+		return ENOMEM;
+	rgn->rgnShared = (flags & MAP_SHARED) != 0;
+
+	*retp = addr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	vaddr_t end;
+	unsigned rgnIdx;
+	int result;
+
+	result = as_check_range(addr, len, &end);
+	if (result)
+		return result;
+
+	// whatever sticks out past either end stays mapped
+	result = as_split_region(as, addr);
+	if (result == 0)
+		result = as_split_region(as, end);
+	if (result)
+		return result;
+
+	while ((rgnIdx = as_find_region(as, addr)) < as->numRegions &&
+	       as->regions[rgnIdx].rgnBase < end)
+		as_remove_region(as, rgnIdx);
+
+	as_unmap_range(as, addr, end);
+	return 0;
+}
+
+int
+as_mprotect(struct addrspace *as, vaddr_t addr, size_t len, int prot)
+{
+	struct as_region *rgn;
+	pageTableEntry_t perms, *pte;
+	vaddr_t end, vaddr;
+	unsigned rgnIdx;
+	int result;
+
+	if ((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) != 0)
+		return EINVAL;
+	result = as_check_range(addr, len, &end);
+	if (result)
+		return result;
+
+	// all of it must be mapped, and shared mappings stay read-only;
+	// segments needn't start or end on a page boundary
+	for (vaddr = addr; vaddr < end;
+	     vaddr = ROUNDUP(rgn->rgnBase + rgn->rgnSize, PAGE_SIZE))
+	{
+		rgnIdx = as_find_region(as, vaddr);
+		if (rgnIdx == as->numRegions)
+			return ENOMEM;
+		rgn = &as->regions[rgnIdx];
+		if ((rgn->rgnBase & PAGE_FRAME) > vaddr)
+			return ENOMEM;
+		if (rgn->rgnShared && (prot & PROT_WRITE))
+			return ENOTSUP;
+	}
+
+	result = as_split_region(as, addr);
+	if (result == 0)
+		result = as_split_region(as, end);
+	if (result)
+		return result;
+
+	for (rgnIdx = as_find_region(as, addr);
+	     rgnIdx < as->numRegions && as->regions[rgnIdx].rgnBase < end;
+	     rgnIdx++)
+		as->regions[rgnIdx].rgnPerms = as_prot_perms(prot);
+
+	// pages already defined carry their permissions in the pte; with
+	// none, vm_fault refuses the page before looking at it
+	cm_paging_acquire();
+	for (vaddr = addr; vaddr < end; vaddr += PAGE_SIZE)
+	{
+		pte = as_lookup_pte(as, vaddr, false);
+		if (pte == NULL || *pte == 0 ||
+		    !as_region_perms(as, vaddr, &perms) || perms == 0)
+			continue;
+		*pte = *pte - PTE_PERMS(*pte) + perms;
+	}
+	vm_tlbcache_flush();
+	cm_paging_release();
 
+	vm_tlb_flush_as(as);
 	return 0;
 }
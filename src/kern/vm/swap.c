@@ -9,32 +9,190 @@
 #include <uio.h>
 #include <kern/fcntl.h>
 #include <kern/errno.h>
+#include <stat.h>
+#include <synch.h>
+
+/* Structures for organizing backing store */
+static struct vnode *swapdisks[SWAP_NDISKS];
+static unsigned swap_ndisks;
+static unsigned swap_total;	/* blocks in swapmap */
+static unsigned swap_ondisk;	/* ...of which on disk; the rest spare */
+static unsigned swap_nstripes;	/* on disk */
+static unsigned swap_next_hint; /* stripe to try first for a new run */
+static struct spinlock swaplock; /* guards swapmap */
+static struct bitmap *swapmap;
+static uint8_t *swap_refs;	/* page tables referring to each block */
+static uint8_t *swap_stripe_free; /* free blocks in each stripe */
+
+#if SWAP_SCRUB
+/* Freed blocks waiting to be zeroed. They stay set in swapmap so
+ * they can't be handed out again with old contents.
+ */
+static unsigned *scrub_pending;
+static unsigned scrub_count;
+static char scrub_zeroes[PAGE_SIZE];
+#endif
+
+#if SWAP_ZPAGES > 0
+/*
+ * Compressed swap cache (see swap.h). The ring holds compressed pages
+ * in the order they were stored, with one entry each in a queue kept in
+ * the same order, so the oldest page is always at the tail of both.
+ * Entries of freed or rewritten blocks are dead: their room comes back
+ * when the tail passes them. zs_lock guards the ring, the queue and
+ * zs_bounce, and is never held across disk I/O; the block index and
+ * entries' blocks are also changed under swaplock, so blocks can be
+ * dropped from the cache as they are freed.
+ *
+ * The oldest page, when still in use, is decoded into zs_bounce and
+ * written back once zs_lock is let go. Until it lands, reads of its
+ * block are served from zs_bounce and writes to it wait, so the old
+ * contents can't land over newer ones.
+ */
+#define ZS_WORDS	(PAGE_SIZE / sizeof(uint32_t))
+#define ZS_TAGBYTES	(ZS_WORDS / 4)
+#define ZS_RING		(SWAP_ZPAGES * PAGE_SIZE)
+/* Entries: as many as the ring holds pages with any literal in them */
+#define ZS_ENTRIES	(ZS_RING / ZS_TAGBYTES)
+
+#define ZS_ZERO		0	/* word is zero */
+#define ZS_REPEAT	1	/* word is the same as the one before */
+#define ZS_LITERAL	2	/* word follows the tags */
+
+struct zs_entry {
+	unsigned ze_block;	/* SWAP_NOBLOCK once dead */
+	unsigned ze_offset;	/* in the ring */
+	unsigned ze_len;	/* 0 for a page of ze_fill words */
+	uint32_t ze_fill;
+};
+
+static struct lock *zs_lock;
+static uint8_t *zs_ring;
+static unsigned zs_head, zs_used;	/* ring bytes */
+static struct zs_entry *zs_entries;
+static unsigned zs_first, zs_count;	/* entry queue */
+static uint16_t *zs_index;		/* entry + 1 per block, 0 if none */
+static uint32_t *zs_bounce;		/* page being written back */
+static unsigned zs_wb_block = SWAP_NOBLOCK; /* ...and its block */
+static struct cv *zs_cv;		/* for the write-back to land */
+
+static struct {
+	unsigned zs_stores;		/* pages kept compressed */
+	unsigned zs_filled;		/* ...of which one repeated word */
+	unsigned zs_loads;		/* pages read back from the cache */
+	unsigned zs_writebacks;		/* pages pushed on to disk */
+	unsigned zs_rejects;		/* pages that didn't compress */
+} zs_stats;
+#endif
+
+/* Number of whole pages on a swap disk */
+static
+unsigned
+swap_disk_pages(struct vnode *vn)
+{
+	struct stat st;
+	int result;
+
+	result = VOP_STAT(vn, &st);
+	if(result) {
+		return 0;
+	}
+	return st.st_size / PAGE_SIZE;
+}
 
 int init_swapdisk(void) {
 		
 	spinlock_init(&swaplock);
 
 	int result;
+	unsigned i, pages, stripes = 0;
+	char name[16];
+
+	/* Attach lhd0:, lhd1:, ... until one is missing */
+	for(i = 0; i < SWAP_NDISKS; i++) {
+		snprintf(name, sizeof(name), "lhd%u:", i);
+		result = vfs_swapon(name, &swapdisks[i]);
+		if(result) {
+			break;
+		}
+
+		pages = swap_disk_pages(swapdisks[i]);
+		if(i == 0 || pages / SWAP_STRIPE < stripes) {
+			stripes = pages / SWAP_STRIPE;
+		}
+		swap_ndisks++;
+	}
 
-	swapmap = bitmap_create(NUM_BLOCKS);
-	KASSERT(swapmap);
-
-	/* Open swapdisk */
-	char *filename = NULL;
-	filename = kstrdup("lhd0raw:");
-	result = vfs_open(filename, O_RDWR, 0, &swapdisk);
+	if(swap_ndisks == 0) {
+		return ENODEV;
+	}
 
-	if(result) {
-		kprintf("Error: failed to open swap disk in init_swapdisk.\n");
+	swap_nstripes = stripes * swap_ndisks;
+	swap_ondisk = swap_nstripes * SWAP_STRIPE;
+	if(swap_ondisk == 0) {
+		return ENOSPC;
 	}
-	KASSERT(swapdisk);
+	swap_total = swap_ondisk + SWAP_ZSPARE;
+
+	swapmap = bitmap_create(swap_total);
+	KASSERT(swapmap);
+	swap_refs = kmalloc(swap_total);
+	KASSERT(swap_refs);
+	bzero(swap_refs, swap_total);
+	/* Spare blocks come in stripes too, past the disks' */
+	swap_stripe_free = kmalloc(swap_total / SWAP_STRIPE);
+	KASSERT(swap_stripe_free);
+	memset(swap_stripe_free, SWAP_STRIPE, swap_total / SWAP_STRIPE);
+#if SWAP_ZPAGES > 0
+	zs_lock = lock_create("zswap");
+	zs_cv = cv_create("zswap");
+	zs_ring = (uint8_t *) alloc_kpages(SWAP_ZPAGES);
+	zs_bounce = (uint32_t *) alloc_kpages(1);
+	zs_entries = kmalloc(ZS_ENTRIES * sizeof(struct zs_entry));
+	zs_index = kmalloc(swap_total * sizeof(uint16_t));
+	KASSERT(zs_lock && zs_cv && zs_ring && zs_bounce && zs_entries &&
+		zs_index);
+	bzero(zs_index, swap_total * sizeof(uint16_t));
+#endif
+#if SWAP_SCRUB
+	scrub_pending = kmalloc(swap_total * sizeof(unsigned));
+	KASSERT(scrub_pending);
+#endif
+
+	kprintf("swap: %u pages on %u disk%s\n", swap_ondisk, swap_ndisks,
+		swap_ndisks == 1 ? "" : "s");
 
 	return 0;
 }
 
+unsigned swap_nblocks(void) {
+	return swap_total;
+}
+
+/* Maps swap block blocknum to its disk and byte offset on that disk */
+static
+struct vnode *
+swap_locate(unsigned blocknum, off_t *offset)
+{
+	unsigned stripe, disk;
+
+	KASSERT(blocknum < swap_ondisk);
+
+	stripe = blocknum / SWAP_STRIPE;
+	disk = stripe % swap_ndisks;
+	*offset = ((off_t) (stripe / swap_ndisks) * SWAP_STRIPE +
+		   blocknum % SWAP_STRIPE) * PAGE_SIZE;
+
+	return swapdisks[disk];
+}
+
 int swap_in(paddr_t pa, unsigned blocknum) {
 
 	int result;
+
+	if(blocknum >= swap_total) {
+		return EINVAL;
+	}
 		
 	result = bitmap_isset(swapmap, blocknum);
 
@@ -42,38 +200,23 @@ int swap_in(paddr_t pa, unsigned blocknum) {
 		return EINVAL;
 	} 
 
+	/* The block stays allocated: the frame remembers it as a clean
+	 * copy, so evicting the page again unmodified needs no write.
+	 */
 	result = read_block(pa, (off_t) blocknum);	
 	if(result) {
 		kprintf("Failed to read swap disk block.\n");
 		return result;
 	}
 
-	struct uio u;
-	struct iovec iov;
-	char zeroes[PAGE_SIZE];
-
-	bzero(zeroes, PAGE_SIZE);
-
-	uio_kinit(&iov, &u, (void *) zeroes, PAGE_SIZE,
-		  (off_t) blocknum, UIO_WRITE);
-	
-	result = VOP_WRITE(swapdisk, &u);
-
-	if(result) {
-		kprintf("Failed to zero out deallocated disk block.\n");
-		return result;
-	}
-
-	clear_map_block(blocknum);
-	
 	return 0;
 }
 
-int swap_out(paddr_t pa, unsigned *blocknum) {
+int swap_out(paddr_t pa, const struct swap_hint *hint, unsigned *blocknum) {
 	
 	int result;
 	
-	result = get_free_block(blocknum);
+	result = get_free_block(hint, blocknum);
 
 	if(result) {
 		kprintf("Swap out failed: No free blocks on swap disk.\n");
@@ -83,6 +226,7 @@ int swap_out(paddr_t pa, unsigned *blocknum) {
 	result = write_frame(pa, (off_t) *blocknum);
 	if(result) {
 		kprintf("Swap out failed: Writing frame failed.\n");
+		clear_map_block(*blocknum);
 		return result;
 	}
 
@@ -91,64 +235,646 @@ int swap_out(paddr_t pa, unsigned *blocknum) {
 	return 0;
 }
 
-int read_block(paddr_t pa, off_t blocknum) {
-	
-	int result;
-	vaddr_t frame_loc = PADDR_TO_KVADDR(pa);
-	
+/*
+ * Moves n pages between the frames in pas and the n swap blocks from
+ * first on in a single disk request. The blocks must lie in one stripe
+ * so they are contiguous on one disk.
+ */
+static
+int
+swap_disk_io(const paddr_t *pas, unsigned n, unsigned first, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
 	struct uio u;
-	struct iovec iov;
+	struct vnode *vn;
+	off_t offset;
+	unsigned i;
 
-	uio_kinit(&iov, &u, (void *) frame_loc, PAGE_SIZE,
-		  blocknum, UIO_READ);	
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+	KASSERT(first / SWAP_STRIPE == (first + n - 1) / SWAP_STRIPE);
+
+	for(i = 0; i < n; i++) {
+		iov[i].iov_kbase = (void *) PADDR_TO_KVADDR(pas[i]);
+		iov[i].iov_len = PAGE_SIZE;
+	}
+
+	vn = swap_locate(first, &offset);
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_offset = offset;
+	u.uio_resid = n * PAGE_SIZE;
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = rw;
+	u.uio_space = NULL;
+
+	/* Disk I/O sleeps: swaplock only guards swapmap */
+	if(rw == UIO_READ) {
+		return VOP_READ(vn, &u);
+	}
+	return VOP_WRITE(vn, &u);
+}
+
+#if SWAP_ZPAGES > 0
+
+/* Compressed size of the page w; 0 if it is one word repeated */
+static
+unsigned
+zs_size(const uint32_t *w)
+{
+	unsigned i, literals = 0;
+	bool filled = true;
+
+	for(i = 0; i < ZS_WORDS; i++) {
+		if(w[i] != w[0]) {
+			filled = false;
+		}
+		if(w[i] != 0 && (i == 0 || w[i] != w[i - 1])) {
+			literals++;
+		}
+	}
+	return filled ? 0 : ZS_TAGBYTES + literals * sizeof(uint32_t);
+}
+
+static
+void
+zs_encode(const uint32_t *w, uint8_t *out)
+{
+	uint32_t *literal = (uint32_t *) (out + ZS_TAGBYTES);
+	unsigned i, tag;
+
+	bzero(out, ZS_TAGBYTES);
+	for(i = 0; i < ZS_WORDS; i++) {
+		if(w[i] == 0) {
+			tag = ZS_ZERO;
+		} else if(i > 0 && w[i] == w[i - 1]) {
+			tag = ZS_REPEAT;
+		} else {
+			tag = ZS_LITERAL;
+			*literal++ = w[i];
+		}
+		out[i / 4] |= tag << (i % 4 * 2);
+	}
+}
+
+static
+void
+zs_decode(const struct zs_entry *e, uint32_t *w)
+{
+	const uint8_t *in = zs_ring + e->ze_offset;
+	const uint32_t *literal = (const uint32_t *) (in + ZS_TAGBYTES);
+	unsigned i;
+
+	for(i = 0; i < ZS_WORDS; i++) {
+		if(e->ze_len == 0) {
+			w[i] = e->ze_fill;
+			continue;
+		}
+		switch((in[i / 4] >> (i % 4 * 2)) & 3) {
+		    case ZS_ZERO:
+			w[i] = 0;
+			break;
+		    case ZS_REPEAT:
+			w[i] = w[i - 1];
+			break;
+		    default:
+			w[i] = *literal++;
+			break;
+		}
+	}
+}
+
+/* Forgets the cached copy of block idx, if any. Caller holds swaplock. */
+static
+void
+zs_drop(unsigned idx)
+{
+	if(zs_index[idx] != 0) {
+		zs_entries[zs_index[idx] - 1].ze_block = SWAP_NOBLOCK;
+		zs_index[idx] = 0;
+	}
+}
+
+/* Waits out a write-back to any of the n blocks from first on */
+static
+void
+zs_wait(unsigned first, unsigned n)
+{
+	KASSERT(lock_do_i_hold(zs_lock));
+
+	while(zs_wb_block >= first && zs_wb_block < first + n) {
+		cv_wait(zs_cv, zs_lock);
+	}
+}
+
+/*
+ * Frees the oldest entry and its room in the ring. If its block is
+ * still in use the page goes to zs_bounce, and wb is set for the
+ * caller to write it back; fails if zs_bounce is taken, or the block
+ * is a spare one that can't be written back.
+ */
+static
+bool
+zs_pop(bool *wb)
+{
+	struct zs_entry *e = zs_entries + zs_first;
+	unsigned block;
+
+	KASSERT(zs_count > 0);
 
 	spinlock_acquire(&swaplock);
+	block = e->ze_block;
+	if(block != SWAP_NOBLOCK) {
+		if(zs_wb_block != SWAP_NOBLOCK || block >= swap_ondisk) {
+			spinlock_release(&swaplock);
+			return false;
+		}
+		e->ze_block = SWAP_NOBLOCK;
+		zs_index[block] = 0;
+		zs_wb_block = block;
+	}
+	spinlock_release(&swaplock);
+
+	if(block != SWAP_NOBLOCK) {
+		zs_decode(e, zs_bounce);
+		zs_stats.zs_writebacks++;
+		*wb = true;
+	}
+
+	/* Room at the end of the ring went unused if the next page
+	 * started over at the beginning
+	 */
+	zs_used -= e->ze_len;
+	if(--zs_count == 0) {
+		zs_head = 0;
+		zs_used = 0;
+	} else {
+		zs_first = (zs_first + 1) % ZS_ENTRIES;
+		if(zs_entries[zs_first].ze_offset < e->ze_offset) {
+			zs_used -= ZS_RING - e->ze_offset - e->ze_len;
+		}
+	}
+	return true;
+}
+
+/* Writes zs_bounce back to its block; caller doesn't hold zs_lock */
+static
+void
+zs_writeback(void)
+{
+	paddr_t pa = KVADDR_TO_PADDR((vaddr_t) zs_bounce);
+	int result;
+
+	/* Only the caller clears zs_wb_block */
+	result = swap_disk_io(&pa, 1, zs_wb_block, UIO_WRITE);
+	if(result) {
+		/* Its page table still points at the block */
+		panic("swap: writing back block %u failed: %s\n",
+		      zs_wb_block, strerror(result));
+	}
+
+	lock_acquire(zs_lock);
+	zs_wb_block = SWAP_NOBLOCK;
+	cv_broadcast(zs_cv, zs_lock);
+	lock_release(zs_lock);
+}
 
-	result = VOP_READ(swapdisk, &u);
+/*
+ * Keeps the page at pa as block idx in the cache if it compresses.
+ * Making room may leave a page in zs_bounce to write back (see
+ * zs_pop). The caller has dropped idx from the cache.
+ */
+static
+bool
+zs_store(paddr_t pa, unsigned idx, bool *wb)
+{
+	const uint32_t *w = (const uint32_t *) PADDR_TO_KVADDR(pa);
+	struct zs_entry *e;
+	unsigned len, offset, pad;
+
+	len = zs_size(w);
+	if(len > SWAP_ZMAXSIZE) {
+		zs_stats.zs_rejects++;
+		return false;
+	}
 
+	/* A page doesn't wrap around the end of the ring */
+	for(;;) {
+		offset = zs_head;
+		pad = 0;
+		if(offset + len > ZS_RING) {
+			pad = ZS_RING - offset;
+			offset = 0;
+		}
+		if(zs_count < ZS_ENTRIES && zs_used + pad + len <= ZS_RING) {
+			break;
+		}
+		if(!zs_pop(wb)) {
+			return false;
+		}
+	}
+
+	if(len > 0) {
+		zs_encode(w, zs_ring + offset);
+	}
+	e = zs_entries + (zs_first + zs_count) % ZS_ENTRIES;
+	e->ze_offset = offset;
+	e->ze_len = len;
+	e->ze_fill = w[0];
+	zs_count++;
+	zs_head = offset + len;
+	zs_used += pad + len;
+
+	spinlock_acquire(&swaplock);
+	e->ze_block = idx;
+	zs_index[idx] = e - zs_entries + 1;
 	spinlock_release(&swaplock);
-		
+
+	zs_stats.zs_stores++;
+	if(len == 0) {
+		zs_stats.zs_filled++;
+	}
+	return true;
+}
+
+/* Reads block idx into pa from the cache; false if it isn't there */
+static
+bool
+zs_load(paddr_t pa, unsigned idx)
+{
+	unsigned entry;
+
+	if(idx == zs_wb_block) {
+		memcpy((void *) PADDR_TO_KVADDR(pa), zs_bounce, PAGE_SIZE);
+		zs_stats.zs_loads++;
+		return true;
+	}
+
+	spinlock_acquire(&swaplock);
+	entry = zs_index[idx];
+	spinlock_release(&swaplock);
+
+	if(entry == 0) {
+		return false;
+	}
+	/* The copy stays: it is what a clean eviction of pa relies on */
+	zs_decode(zs_entries + entry - 1, (uint32_t *) PADDR_TO_KVADDR(pa));
+	zs_stats.zs_loads++;
+	return true;
+}
+
+#endif /* SWAP_ZPAGES */
+
+/*
+ * Moves n pages between pas and the n blocks from first on, through
+ * the compressed cache if there is one: each page the cache takes or
+ * has costs no I/O, and the rest go to disk in runs once zs_lock is
+ * let go. Spare blocks exist only in the cache.
+ */
+static
+int
+swap_io(const paddr_t *pas, unsigned n, unsigned first, enum uio_rw rw)
+{
+#if SWAP_ZPAGES > 0
+	bool cached[SWAP_CLUSTER], wb = false;
+	unsigned i, run;
+	int result = 0;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+
+	lock_acquire(zs_lock);
+	if(rw == UIO_WRITE) {
+		/* Old copies go first, so none is written back over these */
+		zs_wait(first, n);
+		spinlock_acquire(&swaplock);
+		for(i = 0; i < n; i++) {
+			zs_drop(first + i);
+		}
+		spinlock_release(&swaplock);
+	}
+	for(i = 0; i < n; i++) {
+		cached[i] = rw == UIO_READ ? zs_load(pas[i], first + i) :
+			zs_store(pas[i], first + i, &wb);
+	}
+	lock_release(zs_lock);
+
+	if(wb) {
+		zs_writeback();
+	}
+	if(first >= swap_ondisk) {
+		/* A stripe is all spare or all on disk */
+		for(i = 0; i < n; i++) {
+			KASSERT(cached[i] || rw == UIO_WRITE);
+			if(!cached[i]) {
+				return ENOSPC;
+			}
+		}
+		return 0;
+	}
+	for(i = 0; i < n && result == 0; i += run) {
+		run = 1;
+		if(cached[i]) {
+			continue;
+		}
+		while(i + run < n && !cached[i + run]) {
+			run++;
+		}
+		result = swap_disk_io(pas + i, run, first + i, rw);
+	}
+
 	return result;
+#else
+	return swap_disk_io(pas, n, first, rw);
+#endif
+}
+
+int read_block(paddr_t pa, off_t blocknum) {
+	return swap_io(&pa, 1, (unsigned) blocknum, UIO_READ);
 }
 
 int write_frame(paddr_t pa, off_t blocknum) {
+	return swap_io(&pa, 1, (unsigned) blocknum, UIO_WRITE);
+}
 
-	int result;
-	vaddr_t frame_loc = PADDR_TO_KVADDR(pa);
-		
-	struct uio u;
-	struct iovec iov;
+int swap_read_cluster(const paddr_t *pas, unsigned n, unsigned first) {
+	return swap_io(pas, n, first, UIO_READ);
+}
 
-	uio_kinit(&iov, &u, (void *) frame_loc, PAGE_SIZE,
-		  (off_t) blocknum, UIO_WRITE);
+int swap_write_cluster(const paddr_t *pas, unsigned n, unsigned first) {
+	return swap_io(pas, n, first, UIO_WRITE);
+}
+
+/* Marks block idx allocated, with one reference. Caller holds swaplock. */
+static
+void
+swap_take(unsigned idx)
+{
+	bitmap_mark(swapmap, idx);
+	swap_refs[idx] = 1;
+	swap_stripe_free[idx / SWAP_STRIPE]--;
+}
+
+/* Marks block idx free again. Caller holds swaplock. */
+static
+void
+swap_release(unsigned idx)
+{
+#if SWAP_ZPAGES > 0
+	zs_drop(idx);
+#endif
+	bitmap_unmark(swapmap, idx);
+	swap_stripe_free[idx / SWAP_STRIPE]++;
+}
+
+/* True if the n blocks from first on are free and in one stripe */
+static
+bool
+swap_run_free(unsigned first, unsigned n)
+{
+	unsigned i;
+
+	if(first + n > swap_ondisk ||
+	   first / SWAP_STRIPE != (first + n - 1) / SWAP_STRIPE) {
+		return false;
+	}
+	for(i = first; i < first + n; i++) {
+		if(bitmap_isset(swapmap, i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Finds the first block of n free ones for a page placed by hint: the
+ * block asked for, else its slot (or as near as the run fits) in an
+ * empty stripe. The empty stripes are searched one on from the last
+ * one started, to spread new runs across the disks. Returns
+ * SWAP_NOBLOCK if neither is free. Caller holds swaplock.
+ */
+static
+unsigned
+swap_place(unsigned n, const struct swap_hint *hint)
+{
+	unsigned s, stripe, slot;
+
+	if(hint == NULL) {
+		slot = 0;
+	} else if(swap_run_free(hint->sh_block, n)) {
+		return hint->sh_block;
+	} else {
+		slot = hint->sh_slot;
+	}
+	if(slot + n > SWAP_STRIPE) {
+		slot = SWAP_STRIPE - n;
+	}
+
+	for(s = 0; s < swap_nstripes; s++) {
+		stripe = (swap_next_hint + s) % swap_nstripes;
+		if(swap_stripe_free[stripe] == SWAP_STRIPE) {
+			swap_next_hint = stripe + 1;
+			return stripe * SWAP_STRIPE + slot;
+		}
+	}
+	return SWAP_NOBLOCK;
+}
+
+int get_free_block(const struct swap_hint *hint, unsigned *idxptr) {
 	
+	unsigned s, idx, best = SWAP_NOBLOCK;
+
+	if(swapmap == NULL) {
+		return ENOSPC;
+	}
+
 	spinlock_acquire(&swaplock);
 
-	result = VOP_WRITE(swapdisk, &u);
+	idx = swap_place(1, hint);
+	if(idx == SWAP_NOBLOCK) {
+		/* No empty stripe left: fill up the fullest one */
+		for(s = 0; s < swap_nstripes; s++) {
+			if(swap_stripe_free[s] > 0 && (best == SWAP_NOBLOCK ||
+			    swap_stripe_free[s] < swap_stripe_free[best])) {
+				best = s;
+			}
+		}
+		/* Disks full: a spare block, if the cache has one */
+		if(best == SWAP_NOBLOCK) {
+			best = swap_ondisk / SWAP_STRIPE;
+			while(best < swap_total / SWAP_STRIPE &&
+			      swap_stripe_free[best] == 0) {
+				best++;
+			}
+		}
+		if(best == swap_total / SWAP_STRIPE) {
+			spinlock_release(&swaplock);
+			return ENOSPC;
+		}
+		idx = best * SWAP_STRIPE;
+		while(bitmap_isset(swapmap, idx)) {
+			idx++;
+		}
+	}
+	swap_take(idx);
+	*idxptr = idx;
 
 	spinlock_release(&swaplock);
-	
-	return result;
+
+	return 0;
 }
 
-int get_free_block(unsigned *idxptr) {
-	
-	int result;
+int get_free_cluster(unsigned n, const struct swap_hint *hint,
+		     unsigned *firstptr) {
+
+	unsigned s, stripe, i, run, first;
+
+	KASSERT(n > 0 && n <= SWAP_CLUSTER);
+
+	if(swapmap == NULL) {
+		return ENOSPC;
+	}
 
 	spinlock_acquire(&swaplock);
 
-	result =  bitmap_alloc(swapmap, idxptr);	
+	first = swap_place(n, hint);
+	for(s = 0; first == SWAP_NOBLOCK && s < swap_nstripes; s++) {
+		/* Any run long enough in a stripe in use */
+		stripe = (swap_next_hint + s) % swap_nstripes;
+		if(swap_stripe_free[stripe] < n) {
+			continue;
+		}
+		run = 0;
+		for(i = stripe * SWAP_STRIPE; i < (stripe + 1) * SWAP_STRIPE; i++) {
+			run = bitmap_isset(swapmap, i) ? 0 : run + 1;
+			if(run == n) {
+				first = i + 1 - n;
+				break;
+			}
+		}
+	}
+	if(first == SWAP_NOBLOCK) {
+		spinlock_release(&swaplock);
+		return ENOSPC;
+	}
+
+	for(i = first; i < first + n; i++) {
+		swap_take(i);
+	}
+	*firstptr = first;
 
 	spinlock_release(&swaplock);
 
-	return result;
+	return 0;
+}
+
+void swap_share(unsigned idx) {
+
+	spinlock_acquire(&swaplock);
+
+	KASSERT(bitmap_isset(swapmap, idx));
+	KASSERT(swap_refs[idx] > 0 && swap_refs[idx] < 255);
+	swap_refs[idx]++;
+
+	spinlock_release(&swaplock);
+}
+
+bool swap_shared(unsigned idx) {
+
+	bool shared;
+
+	spinlock_acquire(&swaplock);
+	shared = swap_refs[idx] > 1;
+	spinlock_release(&swaplock);
+
+	return shared;
 }
 
 void clear_map_block(unsigned idx) {
 		
 	spinlock_acquire(&swaplock);
 
-	bitmap_unmark(swapmap, idx);
+	/* Still in another address space's page table */
+	KASSERT(swap_refs[idx] > 0);
+	if(--swap_refs[idx] > 0) {
+		spinlock_release(&swaplock);
+		return;
+	}
+
+#if SWAP_SCRUB
+	KASSERT(scrub_count < swap_total);
+	scrub_pending[scrub_count++] = idx;
+#if SWAP_ZPAGES > 0
+	/* Or writing it back would undo the scrub */
+	zs_drop(idx);
+#endif
+#else
+	swap_release(idx);
+#endif
 
 	spinlock_release(&swaplock);
 }
+
+unsigned swap_scrub(unsigned max) {
+
+#if SWAP_SCRUB
+	int result;
+	unsigned idx, scrubbed = 0;
+	struct uio u;
+	struct iovec iov;
+	struct vnode *vn;
+	off_t offset;
+
+	while(scrubbed < max) {
+		spinlock_acquire(&swaplock);
+		if(scrub_count == 0) {
+			spinlock_release(&swaplock);
+			break;
+		}
+		idx = scrub_pending[--scrub_count];
+		spinlock_release(&swaplock);
+
+#if SWAP_ZPAGES > 0
+		lock_acquire(zs_lock);
+		zs_wait(idx, 1);
+		lock_release(zs_lock);
+#endif
+		/* Spare blocks were only ever in the cache */
+		if(idx < swap_ondisk) {
+			vn = swap_locate(idx, &offset);
+			uio_kinit(&iov, &u, (void *) scrub_zeroes, PAGE_SIZE,
+				  offset, UIO_WRITE);
+			result = VOP_WRITE(vn, &u);
+			if(result) {
+				kprintf("Failed to zero out deallocated disk "
+					"block.\n");
+			}
+		}
+
+		/* Release it even so: a failed scrub shouldn't leak swap */
+		spinlock_acquire(&swaplock);
+		swap_release(idx);
+		spinlock_release(&swaplock);
+		scrubbed++;
+	}
+
+	return scrubbed;
+#else
+	(void)max;
+	return 0;
+#endif
+}
+
+void swap_printstats(bool reset) {
+
+#if SWAP_ZPAGES > 0
+	kprintf("swap: %u pages compressed (%u one word), %u rejected\n",
+		zs_stats.zs_stores, zs_stats.zs_filled, zs_stats.zs_rejects);
+	kprintf("swap: %u read back compressed, %u written back to disk, "
+		"%u/%u bytes used\n", zs_stats.zs_loads,
+		zs_stats.zs_writebacks, zs_used, ZS_RING);
+	if(reset) {
+		bzero(&zs_stats, sizeof(zs_stats));
+	}
+#else
+	(void)reset;
+#endif
+}
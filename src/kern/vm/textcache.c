@@ -0,0 +1,178 @@
+/*
+ * Shared text page cache: one copy of each executable's code pages
+ * for all the processes running it.
+ */
+
+#include <textcache.h>
+#include <lib.h>
+#include <uio.h>
+#include <vm.h>
+#include <kern/errno.h>
+
+struct textpage {
+	struct vnode *tp_vnode;		/* NULL if the slot is free */
+	off_t tp_offset;		/* file offset of the page */
+	paddr_t tp_paddr;		/* frame holding it */
+};
+
+/* Protected by the paging lock */
+static struct textpage textcache[TEXTCACHE_PAGES];
+static unsigned textcache_hand;	/* next slot to give up when full */
+
+static
+struct textpage *
+textcache_find(struct vnode *v, off_t offset)
+{
+	unsigned i;
+
+	for(i = 0; i < TEXTCACHE_PAGES; i++) {
+		if(textcache[i].tp_vnode == v &&
+		   textcache[i].tp_offset == offset) {
+			return &textcache[i];
+		}
+	}
+	return NULL;
+}
+
+/* Drops the cache's references; returns true if that freed the frame */
+static
+bool
+textcache_drop(struct textpage *tp)
+{
+	bool last = cm_frame_refcount(tp->tp_paddr) == 1;
+
+	cm_release_frame(tp->tp_paddr);
+	VOP_DECREF(tp->tp_vnode);
+	tp->tp_vnode = NULL;
+
+	return last;
+}
+
+/* A free slot, giving up the oldest page if there isn't one */
+static
+struct textpage *
+textcache_slot(void)
+{
+	struct textpage *tp;
+	unsigned i;
+
+	for(i = 0; i < TEXTCACHE_PAGES; i++) {
+		if(textcache[i].tp_vnode == NULL) {
+			return &textcache[i];
+		}
+	}
+
+	tp = &textcache[textcache_hand];
+	textcache_hand = (textcache_hand + 1) % TEXTCACHE_PAGES;
+	textcache_drop(tp);
+	return tp;
+}
+
+/* Maps a cached page copy-on-write */
+static
+void
+textcache_share(struct textpage *tp, pageTableEntry_t *pte)
+{
+	cm_share_frame(MAKE_PTE(tp->tp_paddr, 0));
+	*pte = MAKE_PTE(tp->tp_paddr, PTE_PERMS(*pte) + COW_BIT + USED_BIT);
+}
+
+int
+textcache_map(struct addrspace *as, vaddr_t vaddr, pageTableEntry_t *pte,
+	      struct vnode *v, off_t offset)
+{
+	struct textpage *tp;
+	struct iovec iov;
+	struct uio u;
+	paddr_t pa;
+	int result;
+
+	KASSERT(!IS_USED_PAGE(*pte) && !IS_ON_DISK(*pte));
+
+	tp = textcache_find(v, offset);
+	if(tp != NULL) {
+		textcache_share(tp, pte);
+		return 0;
+	}
+
+	pa = cm_alloc_frame_evict(as, vaddr, pte);
+	if(pa == 0) {
+		return ENOMEM;
+	}
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(pa), PAGE_SIZE,
+		  offset, UIO_READ);
+	cm_io_begin(pa);
+	result = VOP_READ(v, &u);
+	cm_io_end(pa);
+	KASSERT(!IS_USED_PAGE(*pte) && !IS_ON_DISK(*pte));
+	if(result == 0 && u.uio_resid != 0) {
+		kprintf("ELF: short read on text page - file truncated?\n");
+		result = ENOEXEC;
+	}
+	if(result) {
+		cm_free_frames(pa);
+		return result;
+	}
+
+	/* Another process may have read the page in meanwhile */
+	tp = textcache_find(v, offset);
+	if(tp != NULL) {
+		cm_free_frames(pa);
+		textcache_share(tp, pte);
+		return 0;
+	}
+	cm_mark_filebacked(pa);
+
+	/* The cache's reference keeps the frame when this process exits */
+	tp = textcache_slot();
+	VOP_INCREF(v);
+	tp->tp_vnode = v;
+	tp->tp_offset = offset;
+	tp->tp_paddr = pa;
+	cm_cache_frame(pa);
+
+	*pte = MAKE_PTE(pa, PTE_PERMS(*pte) + COW_BIT + USED_BIT);
+
+	return 0;
+}
+
+bool
+textcache_reclaim(bool any)
+{
+	unsigned i;
+
+	/* Pages no process maps first */
+	for(i = 0; i < TEXTCACHE_PAGES; i++) {
+		if(textcache[i].tp_vnode != NULL &&
+		   cm_frame_refcount(textcache[i].tp_paddr) == 1) {
+			return textcache_drop(&textcache[i]);
+		}
+	}
+	if(!any) {
+		return false;
+	}
+
+	/* Otherwise let go of pages in use: their mappers own them again */
+	for(i = 0; i < TEXTCACHE_PAGES; i++) {
+		if(textcache[i].tp_vnode != NULL &&
+		   textcache_drop(&textcache[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+textcache_forget(paddr_t pa)
+{
+	unsigned i;
+
+	for(i = 0; i < TEXTCACHE_PAGES; i++) {
+		if(textcache[i].tp_vnode != NULL &&
+		   textcache[i].tp_paddr == pa) {
+			textcache_drop(&textcache[i]);
+			return;
+		}
+	}
+}
@@ -0,0 +1,72 @@
+#!/usr/bin/env python2.7
+# vmtest.py - run the VM test programs
+# usage: testscripts/vmtest.py [policy ...]
+#
+# Runs each VM test program in a fresh System/161 (default
+# sys161.conf: 1M of RAM, swap on lhd0:) under each page replacement
+# policy named, all of them by default, first with no resident set
+# limit and then with one. A run fails if the kernel panics or hangs
+# or a program exits nonzero.
+#
+# What the programs exercise:
+#    huge, matmult, sort, palin	 eviction and swap-in under each
+#				 policy, cleaning, clean eviction,
+#				 clustered and striped swap, the
+#				 compressed tier (when SWAP_ZPAGES > 0)
+#    swaptest			 whole pages through swap out of order,
+#				 stale swap copies
+#    zero, zeroshare		 zero-fill, the shared zero frame,
+#				 page groups, sbrk shrinking
+#    mmaptest			 mmap, munmap and mprotect; TLB and
+#				 software TLB invalidation
+#
+# Not run here: parallelvm and the triple* tests need fork, and
+# faulter and mprotfault end in a panic until processes can be killed.
+#
+
+import re
+import sys
+import StringIO
+
+import runtest
+
+policies = ["fifo", "clock", "lru", "wsclock", "random"]
+programs = ["huge", "matmult", "sort", "palin", "swaptest", "zero",
+	"zeroshare", "mmaptest"]
+
+# frames; about a third of the default RAM
+rsslimit = 96
+
+class Tee:
+	def __init__(self):
+		self.buf = StringIO.StringIO()
+	def write(self, s):
+		sys.stdout.write(s)
+		self.buf.write(s)
+	def flush(self):
+		sys.stdout.flush()
+
+def runone(policy, rss, prog):
+	out = Tee()
+	cmds = "vmpolicy %s;vmrss %d;p /testbin/%s;vm" % (policy, rss, prog)
+	msg = runtest.run(cmds, out, progress=60, timeout=900)
+	if msg is None:
+		m = re.search(r"Status (-?\d+) found for", out.buf.getvalue())
+		if m is not None and int(m.group(1)) != 0:
+			msg = "exit status %s" % m.group(1)
+	return msg
+
+failures = []
+for policy in sys.argv[1:] or policies:
+	for rss in [0, rsslimit]:
+		for prog in programs:
+			msg = runone(policy, rss, prog)
+			if msg is not None:
+				failures.append("%s (vmpolicy %s, vmrss %d): %s" %
+					(prog, policy, rss, msg))
+
+for f in failures:
+	sys.stderr.write("vmtest.py: %s\n" % f)
+if failures:
+	exit(1)
+exit(0)
@@ -0,0 +1,20 @@
+/*
+ * Memory mappings: mmap, munmap and mprotect.
+ */
+
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/* Get the PROT_ and MAP_ constants from the kernel */
+#include <kern/mman.h>
+
+/* What mmap returns when it fails */
+#define MAP_FAILED ((void *)-1)
+
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+int mprotect(void *addr, size_t len, int prot);
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,166 @@
+/*
+ * mmaptest.c
+ *
+ * 	Exercises mmap, munmap and mprotect on anonymous memory: zero
+ * 	fill, MAP_FIXED over existing pages, partial munmap, and
+ * 	permission changes that keep a mapping's contents.
+ *
+ * Touching a page it may not touch kills the process, which here takes
+ * the kernel down, so the faulting cases are in mprotfault instead.
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+#include <errno.h>
+
+/*
+ * Caution: OS/161 doesn't provide any way to get this properly from
+ * the kernel. The page size is 4K on almost all hardware... but not
+ * all. If porting to certain weird machines this will need attention.
+ */
+#define PAGE_SIZE 4096
+
+#define NPAGES 4
+
+static
+char *
+page(char *base, unsigned pn)
+{
+	return base + pn * PAGE_SIZE;
+}
+
+static
+void
+fill(char *p, char val)
+{
+	memset(p, val, PAGE_SIZE);
+}
+
+static
+void
+check(char *p, char val, const char *what)
+{
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE; i++) {
+		if (p[i] != val) {
+			errx(1, "%s: byte %u is %d, expected %d",
+			     what, i, p[i], val);
+		}
+	}
+}
+
+static
+char *
+domap(void *addr, size_t len, int prot, int flags)
+{
+	void *p;
+
+	p = mmap(addr, len, prot, flags | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+expect_err(int result, int expected, const char *what)
+{
+	if (result != -1) {
+		errx(1, "%s: succeeded", what);
+	}
+	if (errno != expected) {
+		errx(1, "%s: error %d, expected %d", what, errno, expected);
+	}
+}
+
+int
+main(void)
+{
+	char *base, *p;
+	unsigned i;
+
+	printf("Testing anonymous mappings...\n");
+	base = domap(NULL, NPAGES * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		     MAP_PRIVATE);
+	for (i = 0; i < NPAGES; i++) {
+		check(page(base, i), 0, "zero fill");
+		fill(page(base, i), 'a' + i);
+	}
+
+	printf("Testing partial munmap...\n");
+	if (munmap(page(base, 1), PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	check(page(base, 0), 'a', "below the hole");
+	check(page(base, 2), 'c', "above the hole");
+	check(page(base, 3), 'd', "above the hole");
+
+	printf("Testing MAP_FIXED...\n");
+	/* into the hole */
+	p = domap(page(base, 1), PAGE_SIZE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_FIXED);
+	if (p != page(base, 1)) {
+		errx(1, "MAP_FIXED: got %p instead of %p", p, page(base, 1));
+	}
+	check(p, 0, "MAP_FIXED into a hole");
+	fill(p, 'b');
+	/* over pages that are already mapped */
+	p = domap(page(base, 2), 2 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		  MAP_PRIVATE | MAP_FIXED);
+	if (p != page(base, 2)) {
+		errx(1, "MAP_FIXED: got %p instead of %p", p, page(base, 2));
+	}
+	check(page(base, 2), 0, "MAP_FIXED over a mapping");
+	check(page(base, 3), 0, "MAP_FIXED over a mapping");
+	check(page(base, 0), 'a', "below MAP_FIXED");
+	check(page(base, 1), 'b', "below MAP_FIXED");
+	fill(page(base, 2), 'c');
+	fill(page(base, 3), 'd');
+
+	printf("Testing mprotect...\n");
+	if (mprotect(page(base, 1), 2 * PAGE_SIZE, PROT_READ)) {
+		err(1, "mprotect PROT_READ");
+	}
+	check(page(base, 1), 'b', "read-only");
+	check(page(base, 2), 'c', "read-only");
+	/* the neighbours it split off keep their permissions */
+	fill(page(base, 0), 'A');
+	fill(page(base, 3), 'D');
+	if (mprotect(page(base, 1), PAGE_SIZE, PROT_NONE)) {
+		err(1, "mprotect PROT_NONE");
+	}
+	if (mprotect(page(base, 1), 2 * PAGE_SIZE, PROT_READ | PROT_WRITE)) {
+		err(1, "mprotect PROT_READ|PROT_WRITE");
+	}
+	check(page(base, 1), 'b', "after PROT_NONE");
+	fill(page(base, 1), 'B');
+	fill(page(base, 2), 'C');
+	for (i = 0; i < NPAGES; i++) {
+		check(page(base, i), 'A' + i, "after mprotect");
+	}
+
+	printf("Testing bad arguments...\n");
+	expect_err((int)mmap(NULL, 0, PROT_READ, MAP_PRIVATE | MAP_ANON,
+			     -1, 0), EINVAL, "mmap of no bytes");
+	expect_err((int)mmap(NULL, PAGE_SIZE, PROT_READ, MAP_PRIVATE, 0, 0),
+		   EBADF, "mmap of a file");
+	expect_err((int)mmap(NULL, PAGE_SIZE, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANON, -1, 0),
+		   ENOTSUP, "writable MAP_SHARED");
+	expect_err(munmap(base + 1, PAGE_SIZE), EINVAL, "unaligned munmap");
+	expect_err(mprotect(page(base, NPAGES), PAGE_SIZE, PROT_READ),
+		   ENOMEM, "mprotect past the mapping");
+
+	if (munmap(base, NPAGES * PAGE_SIZE)) {
+		err(1, "munmap");
+	}
+	p = domap(NULL, NPAGES * PAGE_SIZE, PROT_READ, MAP_PRIVATE);
+	check(p, 0, "remapped");
+
+	printf("Passed mmap test.\n");
+	return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * mprotfault.c
+ *
+ * 	Touches a mapped page it has no permission for. With no argument
+ * 	it reads a PROT_NONE page; "ro" writes a PROT_READ page, and
+ * 	"hole" reads a page a partial munmap took out.
+ *
+ * Like faulter, this should run and get killed once processes can be;
+ * until then the kernel panics on the fault, as it does for faulter.
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+/* OS/161 has no way to ask the kernel for this; see sbrktest. */
+#define PAGE_SIZE 4096
+
+int
+main(int argc, char *argv[])
+{
+	const char *how = argc > 1 ? argv[1] : "none";
+	volatile char *p;
+	int prot;
+	char c;
+
+	p = mmap(NULL, 3 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	p[PAGE_SIZE] = 1;
+
+	if (!strcmp(how, "hole")) {
+		if (munmap((char *)p + PAGE_SIZE, PAGE_SIZE)) {
+			err(1, "munmap");
+		}
+	}
+	else {
+		prot = !strcmp(how, "ro") ? PROT_READ : PROT_NONE;
+		if (mprotect((char *)p + PAGE_SIZE, PAGE_SIZE, prot)) {
+			err(1, "mprotect");
+		}
+	}
+	/* the pages either side are still there */
+	p[0] = 1;
+	p[2 * PAGE_SIZE] = 1;
+
+	printf("\nEntering the mprotfault program - I should die immediately\n");
+	if (!strcmp(how, "ro")) {
+		p[PAGE_SIZE] = 2;
+	}
+	else {
+		c = p[PAGE_SIZE];
+		(void)c;
+	}
+
+	printf("I didn't get killed!  Program has a bug\n");
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * swaptest.c
+ *
+ * 	Fills more memory than the machine has with a pattern unique to
+ * 	each word of each page, then checks it back in orders that make
+ * 	pages come in from swap out of sequence: backwards, after a
+ * 	third of them were rewritten, and in a scrambled order.
+ *
+ * Unlike huge, which only looks at the first word of each page, this
+ * catches a page read back into the wrong place (a misplaced cluster),
+ * a stale swap copy reused for a page written since, or a block
+ * handed out twice. Run it with a resident set limit (vmrss) and under
+ * each replacement policy (vmpolicy) as well.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <err.h>
+
+/* OS/161 has no way to ask the kernel for this; see sbrktest. */
+#define PAGE_SIZE	4096
+#define PAGE_WORDS	(PAGE_SIZE / sizeof(unsigned))
+
+/* 1.5M: half again the RAM in the default sys161.conf */
+#define NPAGES		384
+
+static unsigned pages[NPAGES][PAGE_WORDS];
+static unsigned gens[NPAGES];
+
+static
+unsigned
+word(unsigned pn, unsigned w, unsigned gen)
+{
+	return (pn << 16) ^ (w * 2654435761U) ^ gen;
+}
+
+static
+void
+fill(unsigned pn, unsigned gen)
+{
+	unsigned w;
+
+	for (w = 0; w < PAGE_WORDS; w++) {
+		pages[pn][w] = word(pn, w, gen);
+	}
+	gens[pn] = gen;
+}
+
+static
+void
+check(unsigned pn, const char *stage)
+{
+	unsigned w;
+
+	for (w = 0; w < PAGE_WORDS; w++) {
+		if (pages[pn][w] != word(pn, w, gens[pn])) {
+			errx(1, "%s: page %u word %u is 0x%x, expected 0x%x",
+			     stage, pn, w, pages[pn][w],
+			     word(pn, w, gens[pn]));
+		}
+	}
+}
+
+int
+main(void)
+{
+	unsigned i, pn;
+
+	printf("Entering the swaptest program\n");
+
+	for (pn = 0; pn < NPAGES; pn++) {
+		fill(pn, 1);
+	}
+	printf("stage [1] filled\n");
+
+	for (pn = NPAGES; pn-- > 0; ) {
+		check(pn, "backwards");
+	}
+	printf("stage [2] checked backwards\n");
+
+	/* their swap copies are stale now */
+	for (pn = 0; pn < NPAGES; pn += 3) {
+		fill(pn, 2);
+	}
+	for (pn = 0; pn < NPAGES; pn++) {
+		check(pn, "rewritten");
+	}
+	printf("stage [3] rewrote every third page\n");
+
+	/* 97 is prime to NPAGES, so this visits every page once */
+	for (i = 0, pn = 0; i < NPAGES; i++, pn = (pn + 97) % NPAGES) {
+		check(pn, "scrambled");
+		if (i % 2 == 0) {
+			fill(pn, gens[pn] + 1);
+		}
+	}
+	for (i = 0, pn = 0; i < NPAGES; i++, pn = (pn + 97) % NPAGES) {
+		check(pn, "scrambled again");
+	}
+	printf("stage [4] checked in scrambled order\n");
+
+	printf("You passed!\n");
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * zeroshare.c
+ *
+ * 	Checks lazy zero-fill: pages read before they are written share
+ * 	one zero frame, which must stay zero when any of them is
+ * 	written; pages written first come in a group at a time, and the
+ * 	neighbours of the page that faulted must still be zero and still
+ * 	fault to be written. Heap pages given back with sbrk must come
+ * 	back zeroed.
+ *
+ * Like zero, this is more likely to find a problem run after one of
+ * the out-of-core tests (huge, swaptest, matmult).
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <err.h>
+
+/* OS/161 has no way to ask the kernel for this; see sbrktest. */
+#define PAGE_SIZE	4096
+
+/* The kernel fills groups of up to this many aligned pages */
+#define GROUP_PAGES	4
+#define NPAGES		32
+
+static char bss[(NPAGES + GROUP_PAGES) * PAGE_SIZE];
+
+static
+void
+check_zero(const char *p, const char *what)
+{
+	unsigned i;
+
+	for (i = 0; i < PAGE_SIZE; i++) {
+		if (p[i] != 0) {
+			errx(1, "%s: byte %u at %p is %d, not zero",
+			     what, i, &p[i], p[i]);
+		}
+	}
+}
+
+static
+void
+check_mark(const char *p, unsigned pn, const char *what)
+{
+	if (p[0] != (char)(pn + 1) || p[PAGE_SIZE - 1] != (char)(pn + 1)) {
+		errx(1, "%s: page %u lost its contents", what, pn);
+	}
+}
+
+static
+void
+mark(char *p, unsigned pn)
+{
+	p[0] = pn + 1;
+	p[PAGE_SIZE - 1] = pn + 1;
+}
+
+int
+main(void)
+{
+	char *base, *heap;
+	unsigned pn, i;
+	uintptr_t align = GROUP_PAGES * PAGE_SIZE;
+
+	printf("Entering the zeroshare program\n");
+
+	base = (char *)(((uintptr_t)bss + align - 1) & ~(align - 1));
+
+	/* The first half is read before anything is written */
+	for (pn = 0; pn < NPAGES / 2; pn++) {
+		check_zero(base + pn * PAGE_SIZE, "read first");
+	}
+	printf("stage [1] read untouched pages\n");
+
+	/* The second half is written a group's first page at a time */
+	for (pn = NPAGES / 2; pn < NPAGES; pn += GROUP_PAGES) {
+		mark(base + pn * PAGE_SIZE, pn);
+		for (i = 1; i < GROUP_PAGES; i++) {
+			check_zero(base + (pn + i) * PAGE_SIZE, "neighbour");
+		}
+	}
+	for (pn = NPAGES / 2; pn < NPAGES; pn++) {
+		if (pn % GROUP_PAGES != 0) {
+			mark(base + pn * PAGE_SIZE, pn);
+		}
+	}
+	printf("stage [2] wrote groups of pages\n");
+
+	/* Writing every other shared page mustn't show in the rest */
+	for (pn = 0; pn < NPAGES / 2; pn += 2) {
+		mark(base + pn * PAGE_SIZE, pn);
+	}
+	for (pn = 0; pn < NPAGES; pn++) {
+		if (pn < NPAGES / 2 && pn % 2 != 0) {
+			check_zero(base + pn * PAGE_SIZE, "still shared");
+		}
+		else {
+			check_mark(base + pn * PAGE_SIZE, pn, "written");
+		}
+	}
+	printf("stage [3] wrote pages of the zero frame\n");
+
+	heap = sbrk(NPAGES * PAGE_SIZE);
+	if (heap == (void *)-1) {
+		err(1, "sbrk");
+	}
+	for (pn = 0; pn < NPAGES; pn++) {
+		check_zero(heap + pn * PAGE_SIZE, "new heap");
+		mark(heap + pn * PAGE_SIZE, pn);
+	}
+	if (sbrk(-NPAGES * PAGE_SIZE) == (void *)-1) {
+		err(1, "sbrk shrink");
+	}
+	if (sbrk(NPAGES * PAGE_SIZE) != heap) {
+		errx(1, "sbrk: heap moved");
+	}
+	for (pn = 0; pn < NPAGES; pn++) {
+		check_zero(heap + pn * PAGE_SIZE, "regrown heap");
+	}
+	printf("stage [4] regrew the heap\n");
+
+	printf("You passed!\n");
+	return 0;
+}